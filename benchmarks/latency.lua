@@ -0,0 +1,30 @@
+-- Runtime module of the input latency benchmark, loaded by latency.sh through
+-- LITE_XL_RUNTIME. Once the first frame is drawn, it types into the open
+-- document with synthetic key events, then prints the keypress to present
+-- latency measured by the renderer and quits.
+local core = require "core"
+
+local interval = 0.03
+local line = "local value = compute(previous, 42) -- synthetic typing\n"
+local text = line:rep(10)
+
+local step = core.step
+local typing = false
+
+function core.step()
+  local did_redraw = step()
+  if not typing then
+    typing = true
+    renderer.reset_input_latency()
+    system.type_text(text, interval)
+  elseif renderer.get_input_latency() >= #text then
+    local count, p50, p99, max, mean = renderer.get_input_latency()
+    io.stdout:write(string.format(
+      "%d keypresses every %.0f ms: p50 %.1f ms, p99 %.1f ms, max %.1f ms, mean %.2f ms\n",
+      count, interval * 1000, p50 * 1000, p99 * 1000, max * 1000, mean * 1000))
+    core.quit(true)
+  end
+  return did_redraw
+end
+
+return core
@@ -0,0 +1,31 @@
+#!/bin/sh
+# Runs the input latency benchmark: lite-xl is laid out in a temporary prefix
+# like an install, then started headless on a copy of a source file with
+# latency.lua as its runtime module.
+#
+# usage: latency.sh <lite-xl executable> <generated start.lua> <source dir>
+
+set -e
+
+if [ "$#" -ne 3 ]; then
+  echo "usage: $0 <lite-xl> <start.lua> <source-dir>" >&2
+  exit 1
+fi
+exe="$1"
+start="$2"
+source="$3"
+
+run="$(mktemp -d)"
+trap 'rm -rf "$run"' EXIT
+
+mkdir -p "$run/bin" "$run/share/lite-xl" "$run/config/lite-xl" "$run/project"
+cp "$exe" "$run/bin/lite-xl"
+for module_name in core plugins colors fonts; do
+  cp -r "$source/data/$module_name" "$run/share/lite-xl"
+done
+cp "$start" "$run/share/lite-xl/core"
+cp "$source/benchmarks/latency.lua" "$run/config/lite-xl"
+cp "$source/data/core/init.lua" "$run/project/document.lua"
+
+XDG_CONFIG_HOME="$run/config" LITE_XL_HEADLESS=1280x800 LITE_XL_RUNTIME=latency \
+  "$run/bin/lite-xl" "$run/project/document.lua"
@@ -0,0 +1,562 @@
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <SDL.h>
+#include "rencache.h"
+#include "renhash.h"
+
+/* replays a scripted editing session through the rencache on a headless
+** window. The document is a generated C file and every view draws it the way
+** a DocView does: gutter, tokenized lines, line highlight, caret and
+** scrollbar, with the scroll hints the editor gives. The frames per second
+** and the time spent in each stage of the frames are reported, and the pixels
+** of the checkpoints named in the script are checked against a full redraw.
+**
+** A script is a list of commands, one per line:
+**   size <width> <height>            size of the window, before anything else
+**   document <lines>                 generate a document of that many lines
+**   view <x> <y> <w> <h> <line>      add a view scrolled to a line
+**   frames <n> scroll <view> <dy>    draw n frames, scrolling dy pixels each
+**   frames <n> type <view>           draw n frames, typing a character each
+**   checksum <name>                  check the pixels of the last frame
+**   hash <n>                         time hashing the commands of a frame n
+**                                    times, against the FNV-1a used before */
+
+#define MAX_VIEWS 8
+#define MAX_TOKENS 128
+#define MAX_LINE_LEN 1024
+#define PADDING 8
+#define CARET_WIDTH 2
+#define SCROLLBAR_WIDTH 4
+#define WRAP_COLUMN 80
+
+enum { TOKEN_NORMAL, TOKEN_SYMBOL, TOKEN_COMMENT, TOKEN_KEYWORD, TOKEN_KEYWORD2,
+  TOKEN_NUMBER, TOKEN_STRING, TOKEN_FUNCTION };
+
+/* the colors of the default style */
+static const RenColor token_colors[] = {
+  [TOKEN_NORMAL]   = { 0xe6, 0xe1, 0xe1, 0xff },
+  [TOKEN_SYMBOL]   = { 0xfa, 0xdd, 0x93, 0xff },
+  [TOKEN_COMMENT]  = { 0x6f, 0x6b, 0x67, 0xff },
+  [TOKEN_KEYWORD]  = { 0xc9, 0x8a, 0xe5, 0xff },
+  [TOKEN_KEYWORD2] = { 0x83, 0x74, 0xf7, 0xff },
+  [TOKEN_NUMBER]   = { 0x4d, 0xa9, 0xff, 0xff },
+  [TOKEN_STRING]   = { 0x5c, 0xc9, 0xf7, 0xff },
+  [TOKEN_FUNCTION] = { 0xfa, 0xdd, 0x93, 0xff },
+};
+static const RenColor color_background = { 0x32, 0x2e, 0x2e, 0xff };
+static const RenColor color_line_number = { 0x59, 0x52, 0x52, 0xff };
+static const RenColor color_line_number2 = { 0x8f, 0x83, 0x83, 0xff };
+static const RenColor color_line_highlight = { 0x38, 0x34, 0x34, 0xff };
+static const RenColor color_caret = { 0xfa, 0xdd, 0x93, 0xff };
+static const RenColor color_scrollbar = { 0x46, 0x41, 0x41, 0xff };
+
+typedef struct {
+  RenRect rect;
+  int scroll_y, last_scroll_y;
+  int caret_line, caret_col;
+  bool drawn;
+} View;
+
+typedef struct {
+  int frames;
+  double seconds, draw, hash, replay, present;
+  double commands, rects, pixels;
+} Totals;
+
+static char **lines;
+static int line_count, line_capacity;
+static View views[MAX_VIEWS];
+static int view_count, active_view;
+static RenFont *font;
+static int line_height;
+static bool window_ready;
+
+static const char *script_name;
+static int script_line;
+
+
+static void fail(const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  fprintf(stderr, "%s:%d: ", script_name, script_line);
+  vfprintf(stderr, fmt, ap);
+  fprintf(stderr, "\n");
+  va_end(ap);
+  exit(EXIT_FAILURE);
+}
+
+
+static inline int min(int a, int b) { return a < b ? a : b; }
+static inline int max(int a, int b) { return a > b ? a : b; }
+
+
+static char *copy_string(const char *s) {
+  char *copy = strdup(s);
+  if (!copy) { fail("out of memory"); }
+  return copy;
+}
+
+
+/************************* Document *************************/
+
+static uint32_t random_state = 2463534242u;
+
+static uint32_t random_next(uint32_t n) {
+  random_state ^= random_state << 13;
+  random_state ^= random_state >> 17;
+  random_state ^= random_state << 5;
+  return random_state % n;
+}
+
+
+static void insert_line(int idx, char *text) {
+  if (line_count == line_capacity) {
+    line_capacity = line_capacity ? line_capacity * 2 : 1024;
+    lines = realloc(lines, line_capacity * sizeof(char*));
+    if (!lines) { fail("out of memory"); }
+  }
+  memmove(&lines[idx + 1], &lines[idx], (line_count - idx) * sizeof(char*));
+  lines[idx] = text;
+  line_count++;
+}
+
+
+static void push_line(int depth, const char *fmt, ...) {
+  char buf[MAX_LINE_LEN];
+  int n = snprintf(buf, sizeof(buf), "%*s", depth * 2, "");
+  va_list ap;
+  va_start(ap, fmt);
+  vsnprintf(buf + n, sizeof(buf) - n, fmt, ap);
+  va_end(ap);
+  insert_line(line_count, copy_string(buf));
+}
+
+
+/* functions of random statements, always from the same seed */
+static void generate_document(int count) {
+  static const char *types[] = { "int", "char *", "size_t", "double", "bool", "uint32_t" };
+  static const char *words[] = { "buffer", "count", "offset", "line", "state",
+    "index", "value", "result", "node", "width", "height", "cursor" };
+  #define TYPE types[random_next(6)]
+  #define WORD words[random_next(12)]
+  int depth = 0, function = 0;
+  while (line_count < count) {
+    if (depth == 0) {
+      push_line(0, "/* %s the %s of a %s */", WORD, WORD, WORD);
+      push_line(0, "static %s %s_%d(%s %s, const %s %s) {", TYPE, WORD, function++, TYPE, WORD, TYPE, WORD);
+      depth = 1;
+      continue;
+    }
+    switch (random_next(8)) {
+      case 0: push_line(depth, "%s %s_%u = %u;", TYPE, WORD, random_next(100), random_next(100000)); break;
+      case 1: if (depth < 5) { push_line(depth++, "if (%s > %u) {", WORD, random_next(1000)); } break;
+      case 2: push_line(depth, "%s = %s_%u(%s, \"%s %s\");", WORD, WORD, random_next(500), WORD, WORD, WORD); break;
+      case 3: push_line(depth, "// %s the %s before the %s", WORD, WORD, WORD); break;
+      case 4: push_line(depth, "%s += %s * %u.%u;", WORD, WORD, random_next(10), random_next(100)); break;
+      case 5: push_line(depth, "return %s + %u;", WORD, random_next(64)); break;
+      default:
+        push_line(--depth, "}");
+        if (depth == 0) { push_line(0, ""); }
+        break;
+    }
+  }
+  #undef TYPE
+  #undef WORD
+}
+
+
+static bool is_ident(char c) {
+  return c == '_' || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9');
+}
+
+
+static int classify_word(const char *p, int len) {
+  static const char *keywords[] = { "static", "const", "if", "return", NULL };
+  static const char *keywords2[] = { "int", "char", "size_t", "double", "bool", "uint32_t", NULL };
+  for (int i = 0; keywords[i]; i++) {
+    if ((int) strlen(keywords[i]) == len && !memcmp(p, keywords[i], len)) { return TOKEN_KEYWORD; }
+  }
+  for (int i = 0; keywords2[i]; i++) {
+    if ((int) strlen(keywords2[i]) == len && !memcmp(p, keywords2[i], len)) { return TOKEN_KEYWORD2; }
+  }
+  return p[len] == '(' ? TOKEN_FUNCTION : TOKEN_NORMAL;
+}
+
+
+/* splits a line into spans like the C syntax would; the text of each span
+** is copied into buf, as spans are nul terminated */
+static int tokenize(const char *text, RenTextSpan *spans, char *buf) {
+  int count = 0;
+  const char *p = text;
+  while (*p && count < MAX_TOKENS) {
+    const char *start = p;
+    int type;
+    if (p[0] == '/' && (p[1] == '/' || p[1] == '*')) {
+      p += strlen(p);
+      type = TOKEN_COMMENT;
+    } else if (*p == '"') {
+      const char *end = strchr(p + 1, '"');
+      p = end ? end + 1 : p + strlen(p);
+      type = TOKEN_STRING;
+    } else if (*p >= '0' && *p <= '9') {
+      while (is_ident(*p) || *p == '.') { p++; }
+      type = TOKEN_NUMBER;
+    } else if (is_ident(*p)) {
+      while (is_ident(*p)) { p++; }
+      type = classify_word(start, p - start);
+    } else if (*p == ' ') {
+      while (*p == ' ') { p++; }
+      type = TOKEN_NORMAL;
+    } else {
+      p++;
+      type = TOKEN_SYMBOL;
+    }
+    size_t len = p - start;
+    memcpy(buf, start, len);
+    buf[len] = '\0';
+    spans[count++] = (RenTextSpan) { font, token_colors[type], buf, len };
+    buf += len + 1;
+  }
+  return count;
+}
+
+
+static void type_character(View *v) {
+  static const char text[] = "the quick brown fox jumps over the lazy dog; ";
+  static int typed;
+  char *line = lines[v->caret_line];
+  size_t len = strlen(line);
+  if (v->caret_col >= WRAP_COLUMN) {
+    /* break the line at the caret */
+    insert_line(v->caret_line + 1, copy_string(line + v->caret_col));
+    line[v->caret_col] = '\0';
+    v->caret_line++;
+    v->caret_col = 0;
+    return;
+  }
+  line = realloc(line, len + 2);
+  if (!line) { fail("out of memory"); }
+  memmove(line + v->caret_col + 1, line + v->caret_col, len - v->caret_col + 1);
+  line[v->caret_col++] = text[typed++ % (sizeof(text) - 1)];
+  lines[v->caret_line] = line;
+}
+
+
+/************************* Drawing *************************/
+
+static int text_width(const char *text, int len) {
+  char buf[MAX_LINE_LEN];
+  len = min(len, MAX_LINE_LEN - 1);
+  memcpy(buf, text, len);
+  buf[len] = '\0';
+  return ren_font_get_width(font, buf);
+}
+
+
+static void draw_view(View *v, bool active) {
+  RenRect r = v->rect;
+  if (v->drawn && v->last_scroll_y != v->scroll_y) {
+    rencache_scroll_region(r, v->last_scroll_y - v->scroll_y);
+  }
+  v->last_scroll_y = v->scroll_y;
+  v->drawn = true;
+
+  char number[16];
+  snprintf(number, sizeof(number), "%d", line_count);
+  int gutter = text_width(number, strlen(number)) + PADDING * 2;
+  int first = v->scroll_y / line_height;
+  int last = min((v->scroll_y + r.height) / line_height, line_count - 1);
+  int y0 = r.y - v->scroll_y;
+
+  rencache_set_clip_rect(r);
+  rencache_draw_rect(r, color_background);
+  for (int i = first; i <= last; i++) {
+    snprintf(number, sizeof(number), "%d", i + 1);
+    RenColor color = i == v->caret_line ? color_line_number2 : color_line_number;
+    float x = r.x + gutter - PADDING - text_width(number, strlen(number));
+    rencache_draw_text(NULL, font, number, x, y0 + i * line_height, color);
+  }
+
+  RenRect content = { r.x + gutter, r.y, r.width - gutter, r.height };
+  rencache_set_clip_rect(content);
+  RenTextSpan spans[MAX_TOKENS];
+  char buf[MAX_LINE_LEN * 2];
+  for (int i = first; i <= last; i++) {
+    int y = y0 + i * line_height;
+    if (active && i == v->caret_line) {
+      rencache_draw_rect((RenRect) { content.x, y, content.width, line_height }, color_line_highlight);
+    }
+    int count = tokenize(lines[i], spans, buf);
+    if (count > 0) { rencache_draw_tokens(NULL, spans, count, content.x, y); }
+  }
+  if (active && v->caret_line >= first && v->caret_line <= last) {
+    int x = content.x + text_width(lines[v->caret_line], v->caret_col);
+    rencache_draw_rect((RenRect) { x, y0 + v->caret_line * line_height, CARET_WIDTH, line_height }, color_caret);
+  }
+
+  int thumb = max(r.height * r.height / max(line_count * line_height, 1), PADDING);
+  int track = r.height - thumb, range = max(line_count * line_height - r.height, 1);
+  RenRect scrollbar = { r.x + r.width - SCROLLBAR_WIDTH, r.y + (int64_t) track * v->scroll_y / range, SCROLLBAR_WIDTH, thumb };
+  rencache_set_clip_rect(r);
+  rencache_draw_rect(scrollbar, color_scrollbar);
+}
+
+
+static void draw_views(void) {
+  for (int i = 0; i < view_count; i++) {
+    draw_view(&views[i], i == active_view);
+  }
+}
+
+
+static void draw_frame(Totals *totals) {
+  Uint64 start = SDL_GetPerformanceCounter();
+  rencache_begin_frame(NULL);
+  draw_views();
+  rencache_end_frame(NULL);
+  totals->seconds += (double) (SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
+
+  RenFrameStats stats;
+  rencache_get_frame_stats(&stats);
+  totals->frames++;
+  totals->draw += stats.draw;
+  totals->hash += stats.hash;
+  totals->replay += stats.replay;
+  totals->present += stats.present;
+  totals->commands += stats.commands;
+  totals->rects += stats.rects;
+  totals->pixels += stats.pixels;
+}
+
+
+/* FNV-1a over the visible pixels of the surface */
+static uint64_t surface_checksum(void) {
+  SDL_Surface *surface = ren_get_surface();
+  uint64_t h = 0xcbf29ce484222325ULL;
+  for (int y = 0; y < surface->h; y++) {
+    const unsigned char *p = (const unsigned char *) surface->pixels + y * surface->pitch;
+    for (int i = 0; i < surface->w * surface->format->BytesPerPixel; i++) {
+      h = (h ^ p[i]) * 0x100000001b3ULL;
+    }
+  }
+  return h;
+}
+
+
+/************************* Hashing *************************/
+
+/* the commands of a frame, copied one after the other */
+typedef struct {
+  unsigned char *data;
+  size_t len, capacity;
+  size_t *sizes;
+  int count, sizes_capacity;
+} Recording;
+
+
+static void record_command(const void *data, size_t size, void *udata) {
+  Recording *rec = udata;
+  if (rec->len + size > rec->capacity) {
+    rec->capacity = (rec->len + size) * 2;
+    rec->data = realloc(rec->data, rec->capacity);
+  }
+  if (rec->count == rec->sizes_capacity) {
+    rec->sizes_capacity = rec->sizes_capacity ? rec->sizes_capacity * 2 : 1024;
+    rec->sizes = realloc(rec->sizes, rec->sizes_capacity * sizeof(size_t));
+  }
+  if (!rec->data || !rec->sizes) { fail("out of memory"); }
+  memcpy(rec->data + rec->len, data, size);
+  rec->len += size;
+  rec->sizes[rec->count++] = size;
+}
+
+
+/* the 32bit FNV-1a the rencache hashed its commands with, a byte at a time */
+static void hash_fnv1a(unsigned *h, const void *data, size_t size) {
+  const unsigned char *p = data;
+  while (size--) {
+    *h = (*h ^ *p++) * 16777619;
+  }
+}
+
+
+/* keeps the hashes from being optimized out */
+static volatile uint64_t hash_sink;
+
+
+static double time_hashes(const Recording *rec, int iterations, bool fnv1a) {
+  uint64_t acc = 0;
+  Uint64 start = SDL_GetPerformanceCounter();
+  for (int n = 0; n < iterations; n++) {
+    const unsigned char *p = rec->data;
+    for (int i = 0; i < rec->count; i++) {
+      if (fnv1a) {
+        unsigned h = 2166136261u;
+        hash_fnv1a(&h, p, rec->sizes[i]);
+        acc += h;
+      } else {
+        uint64_t h = HASH_INITIAL;
+        hash(&h, p, rec->sizes[i]);
+        acc += h;
+      }
+      p += rec->sizes[i];
+    }
+  }
+  hash_sink = acc;
+  return (double) (SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency() / iterations;
+}
+
+
+static void compare_hashes(int iterations) {
+  Recording rec = { 0 };
+  rencache_begin_frame(NULL);
+  draw_views();
+  rencache_each_command(record_command, &rec);
+  rencache_end_frame(NULL);
+
+  double fnv1a = time_hashes(&rec, iterations, true);
+  double current = time_hashes(&rec, iterations, false);
+  printf("%s:%d: hashing %d commands of %zu bytes, %d times\n", script_name, script_line, rec.count, rec.len, iterations);
+  printf("  fnv-1a  %.3f ms per frame, %.2f GB/s\n", fnv1a * 1000, rec.len / fnv1a / 1e9);
+  printf("  renhash %.3f ms per frame, %.2f GB/s, %.1fx faster\n", current * 1000, rec.len / current / 1e9, fnv1a / current);
+  free(rec.data);
+  free(rec.sizes);
+}
+
+
+/************************* Checkpoints *************************/
+
+static bool checkpoints_failed;
+
+
+/* the frames are drawn incrementally: a checkpoint redraws the last frame
+** in full and checks that it gives the same pixels. Comparing against the
+** renderer itself rather than stored checksums keeps the check valid with
+** any FreeType and SDL */
+static void check_pixels(const char *checkpoint) {
+  uint64_t value = surface_checksum();
+  rencache_invalidate();
+  rencache_begin_frame(NULL);
+  draw_views();
+  rencache_end_frame(NULL);
+  uint64_t expected = surface_checksum();
+  if (value != expected) {
+    printf("%s:%d: %s %016llx: full redraw gives %016llx\n", script_name, script_line, checkpoint,
+      (unsigned long long) value, (unsigned long long) expected);
+    checkpoints_failed = true;
+  } else {
+    printf("%s:%d: %s %016llx: ok\n", script_name, script_line, checkpoint, (unsigned long long) value);
+  }
+}
+
+
+/************************* Script *************************/
+
+static void report(const char *action, const Totals *t) {
+  double n = t->frames > 0 ? t->frames : 1;
+  printf("%s:%d: %d frames %s, %.1f fps\n", script_name, script_line, t->frames, action, t->frames / t->seconds);
+  printf("  per frame: draw %.3f ms, hash %.3f ms, replay %.3f ms, present %.3f ms\n",
+    t->draw * 1000 / n, t->hash * 1000 / n, t->replay * 1000 / n, t->present * 1000 / n);
+  printf("             %.0f commands, %.1f rects, %.0f pixels\n", t->commands / n, t->rects / n, t->pixels / n);
+}
+
+
+static View* get_view(int idx) {
+  if (idx < 1 || idx > view_count) { fail("no view %d", idx); }
+  return &views[idx - 1];
+}
+
+
+static void run_command(char *line, const char *font_path) {
+  char command[32], action[32];
+  int a, b, c, d, e;
+  if (sscanf(line, "%31s", command) != 1 || command[0] == '#') { return; }
+
+  if (!strcmp(command, "size") && sscanf(line, "%*s %d %d", &a, &b) == 2) {
+    if (window_ready) { fail("the size is set once"); }
+    ren_init_headless(a, b);
+    font = ren_font_load(font_path, 14, true, FONT_HINTING_SLIGHT, 0);
+    if (!font) { fail("cannot load font \"%s\"", font_path); }
+    ren_font_set_tab_size(font, 2);
+    line_height = ren_font_get_height(font) * 1.2;
+    window_ready = true;
+    return;
+  }
+  if (!window_ready) { fail("the size must be set first"); }
+
+  if (!strcmp(command, "document") && sscanf(line, "%*s %d", &a) == 1) {
+    generate_document(a);
+  } else if (!strcmp(command, "view") && sscanf(line, "%*s %d %d %d %d %d", &a, &b, &c, &d, &e) == 5) {
+    if (view_count == MAX_VIEWS) { fail("too many views"); }
+    if (e < 1 || e > line_count) { fail("no line %d", e); }
+    views[view_count] = (View) { .rect = { a, b, c, d }, .scroll_y = (e - 1) * line_height, .caret_line = e - 1 };
+    active_view = view_count++;
+  } else if (!strcmp(command, "frames") && sscanf(line, "%*s %d %31s %d", &a, action, &b) == 3) {
+    View *v = get_view(b);
+    active_view = v - views;
+    bool scroll = !strcmp(action, "scroll");
+    if (scroll && sscanf(line, "%*s %*d %*s %*d %d", &c) != 1) { fail("missing scroll distance"); }
+    if (!scroll && strcmp(action, "type")) { fail("unknown action \"%s\"", action); }
+    Totals totals = { 0 };
+    for (int i = 0; i < a; i++) {
+      if (scroll) {
+        int bottom = max(line_count * line_height - v->rect.height, 0);
+        v->scroll_y = min(max(v->scroll_y + c, 0), bottom);
+      } else {
+        type_character(v);
+        /* keep the caret in view, as the editor does */
+        int caret_y = v->caret_line * line_height;
+        if (caret_y + line_height > v->scroll_y + v->rect.height) { v->scroll_y = caret_y + line_height - v->rect.height; }
+      }
+      draw_frame(&totals);
+    }
+    report(action, &totals);
+  } else if (!strcmp(command, "checksum") && sscanf(line, "%*s %31s", action) == 1) {
+    check_pixels(action);
+  } else if (!strcmp(command, "hash") && sscanf(line, "%*s %d", &a) == 1 && a > 0) {
+    compare_hashes(a);
+  } else {
+    fail("invalid command \"%s\"", command);
+  }
+}
+
+
+int main(int argc, char **argv) {
+  int threads = 1, arg = 1;
+  for (; arg < argc && argv[arg][0] == '-'; arg++) {
+    if (!strcmp(argv[arg], "-t") && arg + 1 < argc) {
+      threads = atoi(argv[++arg]);
+    } else {
+      break;
+    }
+  }
+  if (argc - arg != 2) {
+    fprintf(stderr, "usage: %s [-t threads] <font> <script>\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+  const char *font_path = argv[arg];
+  script_name = argv[arg + 1];
+
+  FILE *fp = fopen(script_name, "r");
+  if (!fp) {
+    fprintf(stderr, "error: cannot open \"%s\"\n", script_name);
+    return EXIT_FAILURE;
+  }
+  SDL_Init(SDL_INIT_EVENTS);
+  rencache_set_render_threads(threads);
+
+  char line[256];
+  while (fgets(line, sizeof(line), fp)) {
+    script_line++;
+    run_command(line, font_path);
+  }
+  fclose(fp);
+
+  rencache_set_render_threads(1);
+  SDL_Quit();
+  return checkpoints_failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -129,6 +129,13 @@ command.add(nil, {
     node:add_view(LogView())
   end,
 
+  ["core:log-input-latency"] = function()
+    local count, p50, p99, max = renderer.get_input_latency()
+    core.log("Input latency over %d keypresses: p50 %.1fms, p99 %.1fms, max %.1fms",
+      count, p50 * 1000, p99 * 1000, max * 1000)
+    renderer.reset_input_latency()
+  end,
+
   ["core:open-user-module"] = function()
     local user_module_doc = core.open_doc(USERDIR .. "/init.lua")
     if not user_module_doc then return end
@@ -2,16 +2,21 @@ local config = {}
 
 config.project_scan_rate = 5
 config.fps = 60
+config.render_threads = 1
+config.glyph_cache_limit = 32
+config.double_buffer = false
 config.max_log_items = 80
 config.message_timeout = 5
 config.mouse_wheel_scroll = 50 * SCALE
 config.scroll_past_end = true
 config.file_size_limit = 10
+config.large_file_size = 64
 config.ignore_files = "^%."
 config.symbol_pattern = "[%a_][%w_]*"
 config.non_word_chars = " \t\n/\\()\"':,.;<>~!@#$%^&*|+=[]{}`?-"
 config.undo_merge_timeout = 0.3
 config.max_undos = 10000
+config.undo_memory_limit = 16
 config.max_tabs = 10
 config.always_show_tabs = false
 config.highlight_current_line = true
@@ -14,7 +14,7 @@ function Highlighter:new(doc)
   -- init incremental syntax highlighting
   core.add_thread(function()
     while true do
-      if self.first_invalid_line > self.max_wanted_line then
+      if self.first_invalid_line > self.max_wanted_line or self.doc.large_file then
         self.max_wanted_line = 0
         coroutine.yield(1 / config.fps)
 
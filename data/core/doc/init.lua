@@ -18,8 +18,10 @@ local function split_lines(text)
 end
 
 
-function Doc:new(filename, abs_filename, new_file)
+function Doc:new(filename, abs_filename, new_file, large_file)
   self.new_file = new_file
+  -- large files are mapped read-only and never highlighted
+  self.large_file = large_file
   self:reset()
   if filename then
     self:set_filename(filename, abs_filename)
@@ -31,12 +33,13 @@ end
 
 
 function Doc:reset()
-  self.lines = { "\n" }
+  self.lines = buffer.new()
   self.selections = { 1, 1, 1, 1 }
   self.cursor_clipboard = {}
-  self.undo_stack = { idx = 1 }
-  self.redo_stack = { idx = 1 }
-  self.clean_change_id = 1
+  self.undo_stack = journal.new(config.max_undos, config.undo_memory_limit * 10e5)
+  self.redo_stack = journal.new(config.max_undos, config.undo_memory_limit * 10e5)
+  self.clean_undo_index = 1
+  self.change_id = (self.change_id or 0) + 1
   self.highlighter = Highlighter(self)
   self:reset_syntax()
 end
@@ -44,7 +47,8 @@ end
 
 function Doc:reset_syntax()
   local header = self:get_text(1, 1, self:position_offset(1, 1, 128))
-  local syn = syntax.get(self.filename or "", header)
+  local syn = self.large_file and syntax.plain_text_syntax
+    or syntax.get(self.filename or "", header)
   if self.syntax ~= syn then
     self.syntax = syn
     self.highlighter:reset()
@@ -59,20 +63,17 @@ end
 
 
 function Doc:load(filename)
-  local fp = assert( io.open(filename, "rb") )
+  local load = self.large_file and buffer.map or buffer.load
+  local lines, endings, utf8 = assert( load(filename) )
   self:reset()
-  self.lines = {}
-  for line in fp:lines() do
-    if line:byte(-1) == 13 then
-      line = line:sub(1, -2)
-      self.crlf = true
-    end
-    table.insert(self.lines, line .. "\n")
-  end
-  if #self.lines == 0 then
-    table.insert(self.lines, "\n")
-  end
-  fp:close()
+  self.lines = lines
+  -- mixed endings are saved as "\r\n", like a file using only those
+  self.crlf = endings == "crlf" or endings == "mixed"
+  self.utf8 = utf8
+  if not utf8 then
+    core.log("\"%s\" is not valid UTF-8, some characters may be shown wrong", filename)
+  end
+  if self.large_file then self.disable_symbols = true end
   self:reset_syntax()
 end
 
@@ -83,12 +84,8 @@ function Doc:save(filename, abs_filename)
     filename = self.filename
     abs_filename = self.abs_filename
   end
-  local fp = assert( io.open(filename, "wb") )
-  for _, line in ipairs(self.lines) do
-    if self.crlf then line = line:gsub("\n", "\r\n") end
-    fp:write(line)
-  end
-  fp:close()
+  assert(not self.large_file, "cannot save a file opened in large file mode")
+  assert( self.lines:save(filename, self.crlf) )
   self:set_filename(filename, abs_filename)
   self.new_file = false
   self:reset_syntax()
@@ -102,17 +99,19 @@ end
 
 
 function Doc:is_dirty()
-  return self.clean_change_id ~= self:get_change_id() or self.new_file
+  return self.clean_undo_index ~= self.undo_stack:get_index() or self.new_file
 end
 
 
 function Doc:clean()
-  self.clean_change_id = self:get_change_id()
+  self.clean_undo_index = self.undo_stack:get_index()
 end
 
 
+-- Returns a number that changes with every edit, undo and redo. It is not
+-- the undo index: typing extends the last undo record without moving it.
 function Doc:get_change_id()
-  return self.undo_stack.idx
+  return self.change_id
 end
 
 -- Cursor section. Cursor indices are *only* valid during a get_selections() call.
@@ -281,35 +280,33 @@ end
 
 
 local function push_undo(undo_stack, time, type, ...)
-  undo_stack[undo_stack.idx] = { type = type, time = time, ... }
-  undo_stack[undo_stack.idx - config.max_undos] = nil
-  undo_stack.idx = undo_stack.idx + 1
+  undo_stack:push(time, type, ...)
 end
 
 
 local function pop_undo(self, undo_stack, redo_stack, modified)
   -- pop command
-  local cmd = undo_stack[undo_stack.idx - 1]
-  if not cmd then return end
-  undo_stack.idx = undo_stack.idx - 1
+  local cmd = { undo_stack:pop() }
+  local type, time = cmd[1], cmd[2]
+  if not type then return end
 
   -- handle command
-  if cmd.type == "insert" then
-    local line, col, text = table.unpack(cmd)
-    self:raw_insert(line, col, text, redo_stack, cmd.time)
-  elseif cmd.type == "remove" then
-    local line1, col1, line2, col2 = table.unpack(cmd)
-    self:raw_remove(line1, col1, line2, col2, redo_stack, cmd.time)
-  elseif cmd.type == "selection" then
-    self.selections = { unpack(cmd) }
+  if type == "insert" then
+    local line, col, text = table.unpack(cmd, 3)
+    self:raw_insert(line, col, text, redo_stack, time)
+  elseif type == "remove" then
+    local line1, col1, line2, col2 = table.unpack(cmd, 3)
+    self:raw_remove(line1, col1, line2, col2, redo_stack, time)
+  elseif type == "selection" then
+    self.selections = { table.unpack(cmd, 3) }
   end
 
-  modified = modified or (cmd.type ~= "selection")
+  modified = modified or (type ~= "selection")
 
   -- if next undo command is within the merge timeout then treat as a single
   -- command and continue to execute it
-  local next = undo_stack[undo_stack.idx - 1]
-  if next and math.abs(cmd.time - next.time) < config.undo_merge_timeout then
+  local next_time = undo_stack:peek_time()
+  if next_time and math.abs(time - next_time) < config.undo_merge_timeout then
     return pop_undo(self, undo_stack, redo_stack, modified)
   end
 
@@ -319,7 +316,7 @@ local function pop_undo(self, undo_stack, redo_stack, modified)
 end
 
 
-function Doc:raw_insert(line, col, text, undo_stack, time)
+function Doc:raw_insert(line, col, text, undo_stack, time, merge)
   -- split text into lines and merge with line at insertion point
   local lines = split_lines(text)
   local len = #lines[#lines]
@@ -331,8 +328,8 @@ function Doc:raw_insert(line, col, text, undo_stack, time)
   lines[1] = before .. lines[1]
   lines[#lines] = lines[#lines] .. after
 
-  -- splice lines into line array
-  common.splice(self.lines, line, 1, lines)
+  -- splice lines into line buffer
+  self.lines:splice(line, 1, lines)
   
   -- keep cursors where they should be
   for idx, cline1, ccol1, cline2, ccol2 in self:get_selections(true, true) do
@@ -342,10 +339,16 @@ function Doc:raw_insert(line, col, text, undo_stack, time)
     self:set_selections(idx, cline1 + line_addition, ccol1 + column_addition, cline2 + line_addition, ccol2 + column_addition)
   end
 
-  -- push undo
+  -- push undo; typing right after the previous insert extends its record,
+  -- unless the document was saved in between. Undo and redo replay records
+  -- one for one and never merge, so the undo index stays in step with them
   local line2, col2 = self:position_offset(line, col, #text)
-  push_undo(undo_stack, time, "selection", unpack(self.selections))
-  push_undo(undo_stack, time, "remove", line, col, line2, col2)
+  if not (merge and undo_stack:get_index() ~= self.clean_undo_index
+    and undo_stack:merge_remove(line, col, line2, col2, time, config.undo_merge_timeout)) then
+    push_undo(undo_stack, time, "selection", unpack(self.selections))
+    push_undo(undo_stack, time, "remove", line, col, line2, col2)
+  end
+  self.change_id = self.change_id + 1
 
   -- update highlighter and assure selection is in bounds
   self.highlighter:insert_notify(line, #lines - 1)
@@ -358,13 +361,14 @@ function Doc:raw_remove(line1, col1, line2, col2, undo_stack, time)
   local text = self:get_text(line1, col1, line2, col2)
   push_undo(undo_stack, time, "selection", unpack(self.selections))
   push_undo(undo_stack, time, "insert", line1, col1, text)
+  self.change_id = self.change_id + 1
 
   -- get line content before/after removed text
   local before = self.lines[line1]:sub(1, col1 - 1)
   local after = self.lines[line2]:sub(col2)
 
-  -- splice line into line array
-  common.splice(self.lines, line1, line2 - line1 + 1, { before .. after })
+  -- splice line into line buffer
+  self.lines:splice(line1, line2 - line1 + 1, { before .. after })
   
   -- move all cursors back if they share a line with the removed text
   for idx, cline1, ccol1, cline2, ccol2 in self:get_selections(true, true) do
@@ -381,15 +385,17 @@ end
 
 
 function Doc:insert(line, col, text)
-  self.redo_stack = { idx = 1 }
+  if self.large_file then return end
+  self.redo_stack:clear()
   line, col = self:sanitize_position(line, col)
-  self:raw_insert(line, col, text, self.undo_stack, system.get_time())
+  self:raw_insert(line, col, text, self.undo_stack, system.get_time(), true)
   self:on_text_change("insert")
 end
 
 
 function Doc:remove(line1, col1, line2, col2)
-  self.redo_stack = { idx = 1 }
+  if self.large_file then return end
+  self.redo_stack:clear()
   line1, col1 = self:sanitize_position(line1, col1)
   line2, col2 = self:sanitize_position(line2, col2)
   line1, col1, line2, col2 = sort_positions(line1, col1, line2, col2)
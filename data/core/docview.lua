@@ -56,6 +56,8 @@ function DocView:new(doc)
   self.doc = assert(doc)
   self.font = "code_font"
   self.last_x_offset = {}
+  self.last_draw = {}
+  self.line_offsets = setmetatable({}, { __mode = "k" })
 end
 
 
@@ -145,44 +147,66 @@ function DocView:get_visible_line_range()
 end
 
 
-function DocView:get_col_x_offset(line, col)
+-- Returns the x offset of every byte of the line, plus one past its end. The
+-- result is kept until the line is retokenized or its fonts change.
+function DocView:get_line_offsets(line)
   local default_font = self:get_font()
-  local column = 1
-  local xoffset = 0
+  local highlighted = self.doc.highlighter:get_line(line)
+  local offsets = self.line_offsets[highlighted]
+  if offsets and offsets.font == default_font and offsets.tab_size == config.indent_size then
+    return offsets
+  end
+  offsets = { font = default_font, tab_size = config.indent_size }
+  local n, xoffset = 0, 0
   for _, type, text in self.doc.highlighter:each_token(line) do
     local font = style.syntax_fonts[type] or default_font
-    for char in common.utf8_chars(text) do
-      if column == col then
-        return xoffset
-      end
-      xoffset = xoffset + font:get_width(char)
-      column = column + #char
+    local token_offsets = font:get_offsets(text)
+    for i = 1, #text do
+      offsets[n + i] = xoffset + token_offsets[i]
     end
+    n = n + #text
+    xoffset = xoffset + token_offsets[#text + 1]
   end
+  offsets[n + 1] = xoffset
+  self.line_offsets[highlighted] = offsets
+  return offsets
+end
 
-  return xoffset
+
+function DocView:get_col_x_offset(line, col)
+  local offsets = self:get_line_offsets(line)
+  return offsets[col] or offsets[#offsets]
+end
+
+
+local function is_utf8_cont_byte(text, i)
+  local byte = text:byte(i)
+  return byte and byte >= 0x80 and byte < 0xc0
 end
 
 
 function DocView:get_x_offset_col(line, x)
   local line_text = self.doc.lines[line]
-
-  local xoffset, last_i, i = 0, 1, 1
-  local default_font = self:get_font()
-  for _, type, text in self.doc.highlighter:each_token(line) do
-    local font = style.syntax_fonts[type] or default_font
-    for char in common.utf8_chars(text) do
-      local w = font:get_width(char)
-      if xoffset >= x then
-        return (xoffset - x > w / 2) and last_i or i
-      end
-      xoffset = xoffset + w
-      last_i = i
-      i = i + #char
-    end
+  local offsets = self:get_line_offsets(line)
+  local text = self.doc.highlighter:get_line(line).text
+
+  -- first byte at or past x; bytes of a character share its offset, so this
+  -- is always the start of a character
+  local n = #offsets - 1
+  local lo, hi = 1, n + 1
+  while lo < hi do
+    local mid = math.floor((lo + hi) / 2)
+    if offsets[mid] >= x then hi = mid else lo = mid + 1 end
+  end
+  if lo > n then
+    return #line_text
   end
 
-  return #line_text
+  local next_i, last_i = lo + 1, math.max(lo - 1, 1)
+  while next_i <= n and is_utf8_cont_byte(text, next_i) do next_i = next_i + 1 end
+  while last_i > 1 and is_utf8_cont_byte(text, last_i) do last_i = last_i - 1 end
+  local w = offsets[next_i] - offsets[lo]
+  return (offsets[lo] - x > w / 2) and last_i or lo
 end
 
 
@@ -338,14 +362,27 @@ function DocView:draw_line_highlight(x, y)
 end
 
 
-function DocView:draw_line_text(idx, x, y)
-  local default_font = self:get_font()
-  local tx, ty = x, y + self:get_line_text_y_offset()
-  for _, type, text in self.doc.highlighter:each_token(idx) do
-    local color = style.syntax[type]
-    local font = style.syntax_fonts[type] or default_font
-    tx = renderer.draw_text(font, text, tx, ty, color)
+-- syntax fonts falling back to the font of the view, by view font
+local token_fonts = setmetatable({}, { __mode = "k" })
+
+function DocView:get_token_fonts()
+  local font = self:get_font()
+  if not next(style.syntax_fonts) then return font end
+  local fonts = token_fonts[font]
+  if not fonts then
+    fonts = setmetatable({}, { __index = function(_, type)
+      return style.syntax_fonts[type] or font
+    end })
+    token_fonts[font] = fonts
   end
+  return fonts
+end
+
+
+function DocView:draw_line_text(idx, x, y)
+  local tokens = self.doc.highlighter:get_line(idx).tokens
+  local ty = y + self:get_line_text_y_offset()
+  renderer.draw_tokens(self:get_token_fonts(), tokens, x, ty, style.syntax)
 end
 
 function DocView:draw_caret(x, y)
@@ -416,6 +453,14 @@ function DocView:draw_overlay()
 end
 
 function DocView:draw()
+  -- let the renderer shift what was drawn last frame when only scrolling
+  local _, oy = self:get_content_offset()
+  local pos, size, last = self.position, self.size, self.last_draw
+  if last.x == pos.x and last.y == pos.y and last.w == size.x and last.h == size.y and last.oy ~= oy then
+    renderer.scroll_region(pos.x, pos.y, size.x, size.y, oy - last.oy)
+  end
+  last.x, last.y, last.w, last.h, last.oy = pos.x, pos.y, size.x, size.y, oy
+
   self:draw_background(style.background)
 
   self:get_font():set_tab_size(config.indent_size)
@@ -464,6 +464,7 @@ function core.init()
   end
 
   core.frame_start = 0
+  core.frame_deadline = 0
   core.clip_rect_stack = {{ 0,0,0,0 }}
   core.log_items = {}
   core.docs = {}
@@ -815,7 +816,8 @@ end
 
 
 function core.open_doc(filename)
-  local new_file = not filename or not system.get_file_info(filename)
+  local info = filename and system.get_file_info(filename)
+  local new_file = not info
   local abs_filename
   if filename then
     -- normalize filename and set absolute filename then
@@ -829,9 +831,14 @@ function core.open_doc(filename)
     end
   end
   -- no existing doc for filename; create new
-  local doc = Doc(filename, abs_filename, new_file)
+  local large_file = info and info.size > config.large_file_size * 10e5
+  local doc = Doc(filename, abs_filename, new_file, large_file)
   table.insert(core.docs, doc)
-  core.log_quiet(filename and "Opened doc \"%s\"" or "Opened new doc", filename)
+  if large_file then
+    core.log("Opened large file \"%s\" read-only", filename)
+  else
+    core.log_quiet(filename and "Opened doc \"%s\"" or "Opened new doc", filename)
+  end
   return doc
 end
 
@@ -965,6 +972,7 @@ end
 function core.step()
   -- handle events
   local did_keymap = false
+  local events_start = system.get_time()
 
   for type, a,b,c,d in system.poll_event do
     if type == "textinput" and did_keymap then
@@ -977,6 +985,7 @@ function core.step()
     end
     core.redraw = true
   end
+  local update_start = system.get_time()
 
   local width, height = renderer.get_size()
 
@@ -1003,7 +1012,10 @@ function core.step()
   end
 
   -- draw
-  renderer.begin_frame()
+  renderer.set_render_threads(config.render_threads)
+  renderer.set_glyph_cache_limit(config.glyph_cache_limit * 1024 * 1024)
+  renderer.set_double_buffer(config.double_buffer)
+  renderer.begin_frame(update_start - events_start, system.get_time() - update_start)
   core.clip_rect_stack[1] = { 0, 0, width, height }
   renderer.set_clip_rect(table.unpack(core.clip_rect_stack[1]))
   core.root_view:draw()
@@ -1014,7 +1026,6 @@ end
 
 local run_threads = coroutine.wrap(function()
   while true do
-    local max_time = 1 / config.fps - 0.004
     local need_more_work = false
 
     for k, thread in pairs(core.threads) do
@@ -1035,7 +1046,7 @@ local run_threads = coroutine.wrap(function()
       end
 
       -- stop running threads if we're about to hit the end of frame
-      if system.get_time() - core.frame_start > max_time then
+      if system.get_time() > core.frame_deadline - 0.002 then
         coroutine.yield(true)
       end
     end
@@ -1045,11 +1056,44 @@ local run_threads = coroutine.wrap(function()
 end)
 
 
+-- Returns the time between two frames: a whole number of display refresh
+-- intervals, picked to be the closest to config.fps.
+function core.frame_period()
+  local refresh = system.get_refresh_rate()
+  if not refresh or refresh <= 0 then return 1 / config.fps end
+  local n = math.max(1, math.floor(refresh / config.fps + 0.5))
+  return n / refresh
+end
+
+
+-- Returns the number of seconds until the next cursor blink toggle, or nil if
+-- the cursor does not blink. Sleeping threads are left out on purpose: most
+-- of them poll (the syntax highlighter every frame) and would keep the idle
+-- loop awake; they run on the next event or blink instead.
+local function next_blink(now)
+  if not system.window_has_focus() or config.disable_blink then return end
+  local t = now - core.blink_start
+  local h = config.blink_period / 2
+  local dt = math.ceil(t / h) * h - t
+  return dt > 0 and dt or h
+end
+
+
 function core.run()
   local idle_iterations = 0
+  local next_frame = system.get_time()
   while true do
+    local period = core.frame_period()
     core.frame_start = system.get_time()
+    -- frames are kept on a grid aligned to the display refresh; if we fell
+    -- behind (idle wait, long frame) start a new grid from now
+    if core.frame_start - next_frame > period then
+      next_frame = core.frame_start
+    end
+    next_frame = math.max(next_frame, core.frame_start) + period
+    core.frame_deadline = next_frame
     local did_redraw = core.step()
+    -- spend what is left of the frame budget on background threads
     local need_more_work = run_threads()
     if core.restart_request or core.quit_request then break end
     if not did_redraw and not need_more_work then
@@ -1057,20 +1101,17 @@ function core.run()
       -- do not wait of events at idle_iterations = 1 to give a chance at core.step to run
       -- and set "redraw" flag.
       if idle_iterations > 1 then
-        if system.window_has_focus() then
-          -- keep running even with no events to make the cursor blinks
-          local t = system.get_time() - core.blink_start
-          local h = config.blink_period / 2
-          local dt = math.ceil(t / h) * h - t
-          system.wait_event(dt + 1 / config.fps)
+        local timeout = next_blink(system.get_time())
+        if timeout then
+          -- wait_event works in whole milliseconds, don't wake up too early
+          system.wait_event(timeout + 0.001)
         else
           system.wait_event()
         end
       end
     else
       idle_iterations = 0
-      local elapsed = system.get_time() - core.frame_start
-      system.sleep(math.max(0, 1 / config.fps - elapsed))
+      system.sleep(math.max(0, next_frame - system.get_time()))
     end
   end
 end
@@ -4,6 +4,7 @@ local syntax = {}
 syntax.items = {}
 
 local plain_text_syntax = { patterns = {}, symbols = {} }
+syntax.plain_text_syntax = plain_text_syntax
 
 
 function syntax.add(t)
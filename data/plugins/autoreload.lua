@@ -13,13 +13,18 @@ end
 
 
 local function reload_doc(doc)
-  local fp = io.open(doc.filename, "r")
-  local text = fp:read("*a")
-  fp:close()
-
   local sel = { doc:get_selection() }
-  doc:remove(1, 1, math.huge, math.huge)
-  doc:insert(1, 1, text:gsub("\r", ""):gsub("\n$", ""))
+  if doc.large_file then
+    -- read-only, map the new content instead of editing
+    doc:load(doc.filename)
+  else
+    local fp = io.open(doc.filename, "r")
+    local text = fp:read("*a")
+    fp:close()
+
+    doc:remove(1, 1, math.huge, math.huge)
+    doc:insert(1, 1, text:gsub("\r", ""):gsub("\n$", ""))
+  end
   doc:set_selection(table.unpack(sel))
 
   update_time(doc)
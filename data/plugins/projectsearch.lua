@@ -27,6 +27,13 @@ end
 local function find_all_matches_in_file(t, filename, fn)
   local fp = io.open(filename)
   if not fp then return t end
+  -- skip files that look binary: a NUL byte in their first block
+  local head = fp:read(4096)
+  if head and head:find("\0", 1, true) then
+    fp:close()
+    return t
+  end
+  fp:seek("set")
   local n = 1
   for line in fp:lines() do
     local s = fn(line)
@@ -0,0 +1,73 @@
+---@meta
+
+---
+---Native storage for the lines of a document. Every line keeps its trailing
+---"\n"; a buffer is indexed like an array of strings, `#buffer` gives the
+---number of lines and `ipairs(buffer)` iterates them.
+---@class buffer
+---@field [integer] string
+buffer = {}
+
+---
+---Create a buffer holding the lines of the given text. Line endings are
+---normalized to "\n".
+---
+---@param text? string Defaults to an empty text, which has one empty line.
+---
+---@return buffer
+function buffer.new(text) end
+
+---
+---Load a file into a new buffer. Line endings are normalized to "\n".
+---
+---@param filename string
+---
+---@return buffer? lines
+---@return string endings_or_error The line endings the file used, one of
+---"lf", "crlf", "mixed" or "none", or an error message if it could not be
+---read.
+---@return boolean utf8 True if the file is valid UTF-8.
+function buffer.load(filename) end
+
+---
+---Open a file read-only into a new buffer, for files too large to load.
+---Lines are found with one scan of the file and read from it only when
+---indexed; line endings are normalized to "\n". The buffer can't be
+---spliced. If the file shrinks, the lines past its new end are empty until
+---it is opened again.
+---
+---@param filename string
+---
+---@return buffer? lines
+---@return string endings_or_error The line endings the file used, one of
+---"lf", "crlf", "mixed" or "none", or an error message if it could not be
+---mapped.
+---@return boolean utf8 True if the file is valid UTF-8.
+function buffer.map(filename) end
+
+---
+---Replace `remove` lines starting at line `at` with the given lines.
+---
+---@param at integer
+---@param remove integer
+---@param lines? string[] The new lines, each ending with "\n".
+function buffer:splice(at, remove, lines) end
+
+---
+---Write the buffer to a file. The lines go to a temporary file next to it,
+---which is flushed to disk and renamed over the file, so the file holds
+---either the old or the new content even after a crash.
+---
+---@param filename string
+---@param crlf? boolean Write "\r\n" line endings.
+---
+---@return boolean? ok
+---@return string? message Error message if the file could not be written.
+function buffer:save(filename, crlf) end
+
+---
+---Get the memory used by the buffer.
+---
+---@return number allocated Bytes allocated for the text and line index.
+---@return number text Bytes of text referenced by the lines.
+function buffer:get_memory() end
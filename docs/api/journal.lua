@@ -0,0 +1,71 @@
+---@meta
+
+---
+---Undo and redo stacks of documents. Records are packed in native memory;
+---once a journal holds more records or bytes than allowed, its oldest
+---records are dropped.
+---@class journal
+journal = {}
+
+---
+---Create an empty journal.
+---
+---@param max_records integer
+---@param max_bytes number
+---
+---@return journal
+function journal.new(max_records, max_bytes) end
+
+---
+---Push a record.
+---
+---@param time number
+---@param type string | "'insert'" | "'remove'" | "'selection'"
+---@param ... any For "insert": line, col and text. For "remove": line1,
+---col1, line2 and col2. For "selection": the selection integers.
+function journal:push(time, type, ...) end
+
+---
+---Pop the most recent record.
+---
+---@return string? type Nil if the journal is empty.
+---@return number time
+---@return any ... The arguments the record was pushed with.
+function journal:pop() end
+
+---
+---Get the time of the last edit in the most recent record.
+---
+---@return number? time Nil if the journal is empty.
+function journal:peek_time() end
+
+---
+---Extend the most recent record, if it is a "remove" on the same line ending
+---at line1, col1 and younger than the timeout, to end at line2, col2.
+---
+---@param line1 integer
+---@param col1 integer
+---@param line2 integer
+---@param col2 integer
+---@param time number
+---@param timeout number
+---
+---@return boolean merged
+function journal:merge_remove(line1, col1, line2, col2, time, timeout) end
+
+---
+---Remove all records and reset the index.
+function journal:clear() end
+
+---
+---Get the number of records pushed minus the number popped, starting at 1.
+---
+---@return integer
+function journal:get_index() end
+
+---
+---Get the memory used by the records.
+---
+---@return number bytes
+---@return integer records
+function journal:get_memory() end
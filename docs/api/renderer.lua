@@ -19,6 +19,8 @@ renderer.color = {}
 ---@class renderer.fontoptions
 ---@field public antialiasing "'grayscale'" | "'subpixel'"
 ---@field public hinting "'slight'" | "'none'" | '"full"'
+---@field public async boolean Rasterize the common glyphs on a background
+---thread; text is only laid out, not drawn, until the "fontloaded" event.
 renderer.fontoptions = {}
 
 ---
@@ -39,9 +41,10 @@ function renderer.font.load(path, size, options) end
 ---Clones a font object into a new one.
 ---
 ---@param size? number Optional new size for cloned font.
+---@param options? renderer.fontoptions Only the async option is used.
 ---
 ---@return renderer.font
-function renderer.font:copy(size) end
+function renderer.font:copy(size, options) end
 
 ---
 ---Set the amount of characters that represent a tab.
@@ -58,6 +61,17 @@ function renderer.font:set_tab_size(chars) end
 ---@return number
 function renderer.font:get_width(text) end
 
+---
+---Get the x offset in pixels of every byte of the given text when rendered
+---with this font, in a single call. Bytes inside a multibyte character share
+---the offset of the character; the extra last entry is the width of the
+---whole text.
+---
+---@param text string
+---
+---@return number[] offsets One entry per byte plus one.
+function renderer.font:get_offsets(text) end
+
 ---
 ---Get the width in subpixels of the given text when
 ---rendered with this font.
@@ -113,7 +127,9 @@ function renderer.replacements:add(original_char, replacement_char) end
 
 ---
 ---Toggles drawing debugging rectangles on the currently rendered sections
----of the window to help troubleshoot the renderer.
+---of the window to help troubleshoot the renderer. A graph of the time
+---spent in each stage of the last frames is also drawn in the bottom right
+---corner, with a line marking the budget of a 60 fps frame.
 ---
 ---@param enable boolean
 function renderer.show_debug(enable) end
@@ -125,9 +141,102 @@ function renderer.show_debug(enable) end
 ---@return number height
 function renderer.get_size() end
 
+---
+---Get the memory usage of the render cache command buffer.
+---
+---@return number last_frame Bytes of commands recorded in the last frame.
+---@return number capacity Bytes currently allocated for commands.
+---@return number high_water Largest amount of bytes used by a single frame.
+function renderer.get_command_buffer_stats() end
+
+---
+---Set the number of threads used to redraw the changed regions of the
+---screen. A value of 1 draws everything on the main thread.
+---
+---@param threads integer
+function renderer.set_render_threads(threads) end
+
+---
+---Set the memory bound, in bytes, of the glyph atlas shared by all fonts.
+---Least recently drawn glyphs are dropped when it is exceeded; glyphs drawn
+---in the last frame are always kept.
+---
+---@param bytes number
+function renderer.set_glyph_cache_limit(bytes) end
+
+---
+---Update two window textures in turn instead of one, so that the texture
+---being written is never the one the last frame is still presented from.
+---Only has an effect when built with the SDL renderer.
+---
+---@param enable boolean
+function renderer.set_double_buffer(enable) end
+
+---
+---Get the glyph cache counters since startup. Glyphs are measured when
+---only their advance is needed and rasterized the first time they are
+---drawn at a given subpixel position.
+---
+---@return number measured Glyphs loaded for their metrics only.
+---@return number rasterized Glyph bitmaps rendered.
+---@return number evicted Glyphs dropped from the cache.
+---@return number cache_size Bytes used by the glyph atlas.
+function renderer.get_glyph_stats() end
+
+---
+---Get the counters of the glyph run cache, which keeps the layout of the
+---strings drawn recently so that drawing them again at the same position
+---skips decoding and glyph lookups. The hit rate is hits / (hits + misses).
+---
+---@return number hits Strings drawn from a cached run.
+---@return number misses Strings laid out again.
+---@return number evicted Runs dropped to stay within the cache bound.
+---@return number cache_size Bytes used by the cached runs.
+function renderer.get_layout_stats() end
+
+---
+---Get the timings and counters of the last frame drawn.
+---
+---@class renderer.framestats
+---@field public events number Seconds spent polling events.
+---@field public update number Seconds spent updating views.
+---@field public draw number Seconds spent issuing draw calls.
+---@field public hash number Seconds spent finding the changed regions.
+---@field public replay number Seconds spent redrawing the changed regions.
+---@field public present number Seconds spent updating the window.
+---@field public commands integer Draw commands issued.
+---@field public rects integer Changed regions redrawn.
+---@field public pixels integer Pixels covered by the changed regions.
+---@field public changed_cells integer Cells of the screen whose content changed.
+---@field public redrawn_cells integer Cells covered by the redrawn regions.
+---@field public efficiency number Share of the redrawn area that had changed, from 0 to 1.
+---@field public glyph_misses integer Glyphs loaded into the glyph cache.
+---@field public uploaded integer Bytes sent to the screen.
+---
+---@return renderer.framestats
+function renderer.get_frame_stats() end
+
+---
+---Get the latency from keypresses, as timestamped by the system, to the
+---present of the first frame drawn after them.
+---
+---@return integer count Keypresses measured.
+---@return number p50 Median latency in seconds.
+---@return number p99 99th percentile latency in seconds.
+---@return number max Highest latency in seconds.
+---@return number mean Average latency in seconds.
+function renderer.get_input_latency() end
+
+---
+---Clear the keypress latency measurements.
+function renderer.reset_input_latency() end
+
 ---
 ---Tell the rendering system that we want to build a new frame to render.
-function renderer.begin_frame() end
+---
+---@param events_time? number Seconds spent polling events for this frame.
+---@param update_time? number Seconds spent updating before drawing.
+function renderer.begin_frame(events_time, update_time) end
 
 ---
 ---Tell the rendering system that we finished building the frame.
@@ -152,6 +261,18 @@ function renderer.set_clip_rect(x, y, width, height) end
 ---@param color renderer.color
 function renderer.draw_rect(x, y, width, height, color) end
 
+---
+---Hint that the content drawn inside a rectangle moved vertically since the
+---last frame, as when a view scrolls. What was drawn there is shifted and only
+---the parts found to differ from the shifted pixels are redrawn.
+---
+---@param x number
+---@param y number
+---@param width number
+---@param height number
+---@param dy number Pixels the content moved down; negative when it moved up.
+function renderer.scroll_region(x, y, width, height, dy) end
+
 ---
 ---Draw text.
 ---
@@ -179,3 +300,16 @@ function renderer.draw_text(font, text, x, y, color, replace, color_replace) end
 ---
 ---@return number x_subpixel
 function renderer.draw_text_subpixel(font, text, x, y, color, replace, color_replace) end
+
+---
+---Draw a line of tokens as a single command, each token in the font and
+---color of its type.
+---
+---@param font_map renderer.font|table<string, renderer.font> A font for all tokens or fonts by token type.
+---@param tokens string[] Flat list of token types and texts, as produced by the tokenizer.
+---@param x number
+---@param y number
+---@param color_map table<string, renderer.color> Colors by token type.
+---
+---@return number x_subpixel
+function renderer.draw_tokens(font_map, tokens, x, y, color_map) end
@@ -45,6 +45,9 @@ system.fileinfo = {}
 --- * "mousemoved" -> x, y, relative_x, relative_y
 --- * "mousewheel" -> y
 ---
+---Renderer events:
+--- * "fontloaded"
+---
 ---@return string type
 ---@return any? arg1
 ---@return any? arg2
@@ -131,6 +134,21 @@ function system.set_window_size(width, height, x, y) end
 ---@return boolean
 function system.window_has_focus() end
 
+---
+---Get the refresh rate of the display the window is on.
+---
+---@return integer? refresh_rate In Hz, nil if unknown.
+function system.get_refresh_rate() end
+
+---
+---Type text with synthetic key events, one character every interval seconds,
+---pushed from a timer thread like a keyboard would. Only available when
+---running headless, for benchmarks.
+---
+---@param text string A "\n" presses return.
+---@param interval number
+function system.type_text(text, interval) end
+
 ---
 ---Opens a message box to display an error message.
 ---
@@ -5,12 +5,16 @@ int luaopen_system(lua_State *L);
 int luaopen_renderer(lua_State *L);
 int luaopen_regex(lua_State *L);
 int luaopen_process(lua_State *L);
+int luaopen_buffer(lua_State *L);
+int luaopen_journal(lua_State *L);
 
 static const luaL_Reg libs[] = {
   { "system",    luaopen_system     },
   { "renderer",  luaopen_renderer   },
   { "regex",     luaopen_regex   },
   { "process",   luaopen_process    },
+  { "buffer",    luaopen_buffer     },
+  { "journal",   luaopen_journal    },
   { NULL, NULL }
 };
 
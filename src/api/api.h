@@ -7,6 +7,8 @@
 
 #define API_TYPE_FONT "Font"
 #define API_TYPE_PROCESS "Process"
+#define API_TYPE_BUFFER "Buffer"
+#define API_TYPE_JOURNAL "Journal"
 
 void api_load_libs(lua_State *L);
 
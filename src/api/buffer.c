@@ -0,0 +1,788 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+  #include <windows.h>
+  #include <io.h>
+#else
+  #include <sys/mman.h>
+  #include <sys/uio.h>
+  #include <unistd.h>
+#endif
+#include "api.h"
+#include "fileindex.h"
+
+/* the text of a document: a piece table split at line boundaries. All the
+** text lives in one append-only store -- the loaded file first, then the
+** text of every edit -- and each line is a (offset, length) piece into it,
+** the trailing "\n" included. The pieces are kept in a gap buffer so that
+** splicing lines costs the distance to the previous edit instead of the
+** lines after it, and the store is compacted once mostly garbage.
+**
+** Huge files are opened read-only instead: the file is mapped once to be
+** indexed by file_index, remembering where every MAP_INDEX_STRIDE-th line
+** starts, then unmapped. A line is only read from the file when it is asked
+** for, through a cache of the last MAP_BLOCK_SIZE block read; reading rather
+** than keeping the mapping means a file truncated behind our back (a log
+** rotated with copytruncate) reads short instead of faulting on access */
+
+#define STORE_MIN_SIZE (64 * 1024)
+#define GAP_MIN_SIZE 64
+#define MAP_INDEX_STRIDE 64
+#define MAP_BLOCK_SIZE (64 * 1024)
+#define SAVE_IOV_BATCH 256
+
+typedef struct {
+  size_t offset, len;
+} Line;
+
+typedef struct {
+  char *text;
+  size_t text_len, text_cap;
+  /* bytes of the store still referenced by a line */
+  size_t live;
+  /* lines [0, gap_start) and [gap_end, cap) */
+  Line *lines;
+  size_t gap_start, gap_end, cap;
+  /* read-only file: its mapping while it is indexed, the start of every
+  ** MAP_INDEX_STRIDE-th line and the last block read */
+  bool mapped;
+  const char *map;
+  size_t map_len, map_lines;
+  size_t *map_index;
+  char *map_block;
+  size_t map_block_offset, map_block_len;
+#ifdef _WIN32
+  HANDLE map_file, map_handle;
+#else
+  int map_fd;
+#endif
+} Buffer;
+
+
+static size_t line_count(const Buffer *b) {
+  if (b->mapped) { return b->map_lines; }
+  return b->gap_start + b->cap - b->gap_end;
+}
+
+
+static Line *get_line(Buffer *b, size_t i) {
+  return &b->lines[i < b->gap_start ? i : i + b->gap_end - b->gap_start];
+}
+
+
+static void move_gap(Buffer *b, size_t at) {
+  if (at < b->gap_start) {
+    size_t n = b->gap_start - at;
+    memmove(b->lines + b->gap_end - n, b->lines + at, n * sizeof(Line));
+    b->gap_start -= n;
+    b->gap_end -= n;
+  } else if (at > b->gap_start) {
+    size_t n = at - b->gap_start;
+    memmove(b->lines + b->gap_start, b->lines + b->gap_end, n * sizeof(Line));
+    b->gap_start += n;
+    b->gap_end += n;
+  }
+}
+
+
+static void reserve_lines(lua_State *L, Buffer *b, size_t n) {
+  if (b->gap_end - b->gap_start >= n) { return; }
+  size_t count = line_count(b);
+  size_t cap = b->cap * 2;
+  if (cap < count + n + GAP_MIN_SIZE) { cap = count + n + GAP_MIN_SIZE; }
+  Line *lines = realloc(b->lines, cap * sizeof(Line));
+  if (!lines) { luaL_error(L, "buffer allocation failed"); }
+  size_t tail = b->cap - b->gap_end;
+  memmove(lines + cap - tail, lines + b->gap_end, tail * sizeof(Line));
+  b->lines = lines;
+  b->gap_end = cap - tail;
+  b->cap = cap;
+}
+
+
+/* copies the live lines into a new store, dropping the text of old edits */
+static void compact_store(lua_State *L, Buffer *b, size_t extra) {
+  size_t cap = (b->live + extra) * 2;
+  if (cap < STORE_MIN_SIZE) { cap = STORE_MIN_SIZE; }
+  char *text = malloc(cap);
+  if (!text) { luaL_error(L, "buffer allocation failed"); }
+  size_t len = 0, count = line_count(b);
+  for (size_t i = 0; i < count; i++) {
+    Line *line = get_line(b, i);
+    memcpy(text + len, b->text + line->offset, line->len);
+    line->offset = len;
+    len += line->len;
+  }
+  free(b->text);
+  b->text = text;
+  b->text_len = len;
+  b->text_cap = cap;
+}
+
+
+static size_t append_text(lua_State *L, Buffer *b, const char *text, size_t len) {
+  if (b->text_len + len > b->text_cap) {
+    if (b->text_len > b->live * 2) {
+      compact_store(L, b, len);
+    } else {
+      size_t cap = b->text_cap * 2;
+      if (cap < b->text_len + len) { cap = b->text_len + len; }
+      if (cap < STORE_MIN_SIZE) { cap = STORE_MIN_SIZE; }
+      char *store = realloc(b->text, cap);
+      if (!store) { luaL_error(L, "buffer allocation failed"); }
+      b->text = store;
+      b->text_cap = cap;
+    }
+  }
+  size_t offset = b->text_len;
+  memcpy(b->text + offset, text, len);
+  b->text_len += len;
+  b->live += len;
+  return offset;
+}
+
+
+static Buffer *new_buffer(lua_State *L) {
+  Buffer *b = lua_newuserdata(L, sizeof(Buffer));
+  memset(b, 0, sizeof(Buffer));
+  luaL_setmetatable(L, API_TYPE_BUFFER);
+  return b;
+}
+
+
+/* splits the store into lines in place: "\r\n" becomes "\n" and the last
+** line gets a "\n" if it had none; the store needs one spare byte for it */
+static void index_lines(lua_State *L, Buffer *b) {
+  size_t read = 0, write = 0, start = 0;
+  while (read < b->text_len) {
+    char *nl = memchr(b->text + read, '\n', b->text_len - read);
+    size_t end = nl ? (size_t) (nl - b->text) : b->text_len;
+    size_t len = end - read;
+    if (len > 0 && b->text[end - 1] == '\r') { len--; }
+    memmove(b->text + write, b->text + read, len);
+    b->text[write + len] = '\n';
+    reserve_lines(L, b, 1);
+    b->lines[b->gap_start++] = (Line) { start, len + 1 };
+    write += len + 1;
+    start = write;
+    read = end + 1;
+  }
+  b->text_len = b->live = write;
+}
+
+
+static int f_buffer_new(lua_State *L) {
+  size_t len = 0;
+  const char *text = luaL_optlstring(L, 1, "", &len);
+  Buffer *b = new_buffer(L);
+  b->text = malloc(len + 1);
+  if (!b->text) { luaL_error(L, "buffer allocation failed"); }
+  memcpy(b->text, text, len);
+  b->text_len = len;
+  b->text_cap = len + 1;
+  index_lines(L, b);
+  /* an empty text, or one ending with "\n", still has a last empty line */
+  if (len == 0 || text[len - 1] == '\n') {
+    reserve_lines(L, b, 1);
+    b->lines[b->gap_start++] = (Line) { append_text(L, b, "\n", 1), 1 };
+  }
+  return 1;
+}
+
+
+static int f_buffer_load(lua_State *L) {
+  const char *filename = luaL_checkstring(L, 1);
+  FILE *fp = fopen(filename, "rb");
+  if (!fp) {
+    lua_pushnil(L);
+    lua_pushfstring(L, "%s: %s", filename, strerror(errno));
+    return 2;
+  }
+  Buffer *b = new_buffer(L);
+  fseek(fp, 0, SEEK_END);
+  long size = ftell(fp);
+  fseek(fp, 0, SEEK_SET);
+  b->text_cap = (size > 0 ? size : 0) + 1;
+  b->text = malloc(b->text_cap);
+  if (!b->text) {
+    fclose(fp);
+    luaL_error(L, "buffer allocation failed");
+  }
+  b->text_len = size > 0 ? fread(b->text, 1, size, fp) : 0;
+  if (ferror(fp)) {
+    int err = errno;
+    fclose(fp);
+    lua_pushnil(L);
+    lua_pushfstring(L, "%s: %s", filename, strerror(err));
+    return 2;
+  }
+  fclose(fp);
+  /* the endings and encoding are found before the lines are normalized */
+  FileIndex index;
+  if (!file_index(b->text, b->text_len, 0, &index)) {
+    luaL_error(L, "buffer allocation failed");
+  }
+  index_lines(L, b);
+  if (line_count(b) == 0) {
+    reserve_lines(L, b, 1);
+    b->lines[b->gap_start++] = (Line) { append_text(L, b, "\n", 1), 1 };
+  }
+  lua_pushstring(L, file_index_endings(&index));
+  lua_pushboolean(L, index.utf8);
+  return 3;
+}
+
+
+/* opens the file and maps it for file_index; the file stays open */
+static const char *map_file(Buffer *b, const char *filename) {
+#ifdef _WIN32
+  HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE,
+    NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (file == INVALID_HANDLE_VALUE) { return "cannot open file"; }
+  LARGE_INTEGER size;
+  if (!GetFileSizeEx(file, &size)) {
+    CloseHandle(file);
+    return "cannot get file size";
+  }
+  if (size.QuadPart > 0) {
+    b->map_handle = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    b->map = b->map_handle ? MapViewOfFile(b->map_handle, FILE_MAP_READ, 0, 0, 0) : NULL;
+    if (!b->map) {
+      if (b->map_handle) { CloseHandle(b->map_handle); }
+      b->map_handle = NULL;
+      CloseHandle(file);
+      return "cannot map file";
+    }
+    b->map_len = size.QuadPart;
+  }
+  b->map_file = file;
+#else
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) { return strerror(errno); }
+  struct stat info;
+  if (fstat(fd, &info) < 0 || !S_ISREG(info.st_mode)) {
+    close(fd);
+    return "not a regular file";
+  }
+  if (info.st_size > 0) {
+    void *map = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+      const char *err = strerror(errno);
+      close(fd);
+      return err;
+    }
+    madvise(map, info.st_size, MADV_SEQUENTIAL);
+    b->map = map;
+    b->map_len = info.st_size;
+  }
+  b->map_fd = fd;
+#endif
+  b->mapped = true;
+  return NULL;
+}
+
+
+static void unmap_file(Buffer *b) {
+  if (!b->map) { return; }
+#ifdef _WIN32
+  UnmapViewOfFile(b->map);
+  CloseHandle(b->map_handle);
+#else
+  munmap((void *) b->map, b->map_len);
+#endif
+  b->map = NULL;
+}
+
+
+static void close_file(Buffer *b) {
+  if (!b->mapped) { return; }
+  unmap_file(b);
+#ifdef _WIN32
+  CloseHandle(b->map_file);
+#else
+  close(b->map_fd);
+#endif
+  b->mapped = false;
+}
+
+
+/* reads up to size bytes at offset; past the end of the file, or on error,
+** fewer or none */
+static size_t read_file(Buffer *b, char *dst, size_t size, size_t offset) {
+#ifdef _WIN32
+  OVERLAPPED at = { 0 };
+  at.Offset = (DWORD) offset;
+  at.OffsetHigh = (DWORD) ((unsigned long long) offset >> 32);
+  DWORD n = 0;
+  if (!ReadFile(b->map_file, dst, (DWORD) size, &n, &at)) { return 0; }
+  return n;
+#else
+  ssize_t n;
+  do {
+    n = pread(b->map_fd, dst, size, offset);
+  } while (n < 0 && errno == EINTR);
+  return n > 0 ? (size_t) n : 0;
+#endif
+}
+
+
+static int f_buffer_map(lua_State *L) {
+  const char *filename = luaL_checkstring(L, 1);
+  Buffer *b = new_buffer(L);
+  const char *err = map_file(b, filename);
+  if (err) {
+    lua_pushnil(L);
+    lua_pushfstring(L, "%s: %s", filename, err);
+    return 2;
+  }
+  FileIndex index = { .utf8 = true };
+  if (b->map_len > 0) {
+    if (!file_index(b->map, b->map_len, MAP_INDEX_STRIDE, &index)) {
+      luaL_error(L, "buffer allocation failed");
+    }
+    b->map_index = index.offsets;
+    b->map_lines = index.lines;
+  } else {
+    /* an empty file still has one empty line */
+    b->map_lines = 1;
+  }
+  /* from now on lines are read from the file */
+  unmap_file(b);
+  b->map_block = malloc(MAP_BLOCK_SIZE);
+  if (!b->map_block) { luaL_error(L, "buffer allocation failed"); }
+  lua_pushstring(L, file_index_endings(&index));
+  lua_pushboolean(L, index.utf8);
+  return 3;
+}
+
+
+#ifdef _WIN32
+struct iovec {
+  void *iov_base;
+  size_t iov_len;
+};
+#endif
+
+/* lines are written straight from the store, SAVE_IOV_BATCH pieces per
+** writev; pieces that follow each other in the store go out as one */
+typedef struct {
+  int fd;
+  struct iovec iov[SAVE_IOV_BATCH];
+  int count;
+} SaveBatch;
+
+
+static int flush_batch(SaveBatch *s) {
+#ifdef _WIN32
+  for (int i = 0; i < s->count; i++) {
+    const char *p = s->iov[i].iov_base;
+    size_t len = s->iov[i].iov_len;
+    while (len > 0) {
+      int n = _write(s->fd, p, len > (1u << 30) ? (1u << 30) : (unsigned) len);
+      if (n < 0) { return 0; }
+      p += n;
+      len -= n;
+    }
+  }
+#else
+  struct iovec *iov = s->iov;
+  int count = s->count;
+  while (count > 0) {
+    ssize_t n = writev(s->fd, iov, count);
+    if (n < 0) {
+      if (errno == EINTR) { continue; }
+      return 0;
+    }
+    /* resume a short write where it stopped */
+    while (count > 0 && (size_t) n >= iov->iov_len) {
+      n -= iov->iov_len;
+      iov++;
+      count--;
+    }
+    if (count > 0) {
+      iov->iov_base = (char *) iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+#endif
+  s->count = 0;
+  return 1;
+}
+
+
+static int batch_write(SaveBatch *s, const char *p, size_t len) {
+  if (len == 0) { return 1; }
+  if (s->count > 0) {
+    struct iovec *last = &s->iov[s->count - 1];
+    if ((const char *) last->iov_base + last->iov_len == p) {
+      last->iov_len += len;
+      return 1;
+    }
+  }
+  if (s->count == SAVE_IOV_BATCH && !flush_batch(s)) { return 0; }
+  s->iov[s->count++] = (struct iovec) { (void *) p, len };
+  return 1;
+}
+
+
+static int write_lines(Buffer *b, int fd, int crlf) {
+  SaveBatch s = { .fd = fd };
+  size_t count = line_count(b);
+  for (size_t i = 0; i < count; i++) {
+    Line *line = get_line(b, i);
+    const char *p = b->text + line->offset;
+    size_t len = line->len;
+    if (crlf && len > 0 && p[len - 1] == '\n') {
+      if (!batch_write(&s, p, len - 1) || !batch_write(&s, "\r\n", 2)) { return 0; }
+    } else if (!batch_write(&s, p, len)) {
+      return 0;
+    }
+  }
+  return flush_batch(&s);
+}
+
+
+/* the temporary file is created next to the target, so that renaming it
+** over the target is atomic: ".name.XXXXXX" */
+static char *temp_path(const char *target) {
+  const char *base = strrchr(target, '/');
+#ifdef _WIN32
+  const char *bs = strrchr(target, '\\');
+  if (!base || (bs && bs > base)) { base = bs; }
+#endif
+  size_t dir_len = base ? (size_t) (base - target) + 1 : 0;
+  base = target + dir_len;
+  char *path = malloc(dir_len + strlen(base) + 9);
+  if (!path) { return NULL; }
+  sprintf(path, "%.*s.%s.XXXXXX", (int) dir_len, target, base);
+  return path;
+}
+
+
+static int open_temp(char *path, const char *target) {
+#ifdef _WIN32
+  if (_mktemp_s(path, strlen(path) + 1) != 0) { return -1; }
+  (void) target;
+  return _open(path, _O_WRONLY | _O_CREAT | _O_EXCL | _O_BINARY, _S_IREAD | _S_IWRITE);
+#else
+  int fd = mkstemp(path);
+  if (fd < 0) { return -1; }
+  /* keep the owner and permissions of the file being replaced */
+  struct stat info;
+  mode_t mode;
+  if (stat(target, &info) == 0) {
+    /* best effort: only root can give the file to another user */
+    if (fchown(fd, info.st_uid, info.st_gid) != 0) {}
+    mode = info.st_mode & 07777;
+  } else {
+    mode = umask(0);
+    umask(mode);
+    mode = 0666 & ~mode;
+  }
+  fchmod(fd, mode);
+  return fd;
+#endif
+}
+
+
+static int commit_temp(int fd, const char *path, const char *target) {
+#ifdef _WIN32
+  if (_commit(fd) != 0) { _close(fd); return 0; }
+  if (_close(fd) != 0) { return 0; }
+  return MoveFileExA(path, target, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+#else
+  if (fsync(fd) != 0) { close(fd); return 0; }
+  if (close(fd) != 0) { return 0; }
+  if (rename(path, target) != 0) { return 0; }
+  /* make the rename itself durable */
+  char *dir = strdup(target);
+  if (dir) {
+    char *slash = strrchr(dir, '/');
+    if (slash == dir) {
+      slash[1] = '\0';
+    } else if (slash) {
+      *slash = '\0';
+    } else {
+      strcpy(dir, ".");
+    }
+    int dir_fd = open(dir, O_RDONLY);
+    if (dir_fd >= 0) {
+      fsync(dir_fd);
+      close(dir_fd);
+    }
+    free(dir);
+  }
+  return 1;
+#endif
+}
+
+
+/* hard links of the target would keep its old content after a rename */
+static int has_other_links(const char *target) {
+#ifdef _WIN32
+  (void) target;
+  return 0;
+#else
+  struct stat info;
+  return stat(target, &info) == 0 && info.st_nlink > 1;
+#endif
+}
+
+
+/* writes over the target itself, for when renaming a temporary file over it
+** can't be done. Unlike the rename, a failed write leaves it truncated */
+static int save_in_place(Buffer *b, const char *target, int crlf) {
+#ifdef _WIN32
+  int fd = _open(target, _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY, _S_IREAD | _S_IWRITE);
+  if (fd < 0) { return 0; }
+  int ok = write_lines(b, fd, crlf) && _commit(fd) == 0, err = errno;
+  if (_close(fd) != 0 && ok) { ok = 0; err = errno; }
+#else
+  int fd = open(target, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (fd < 0) { return 0; }
+  int ok = write_lines(b, fd, crlf) && fsync(fd) == 0, err = errno;
+  if (close(fd) != 0 && ok) { ok = 0; err = errno; }
+#endif
+  errno = err;
+  return ok;
+}
+
+
+static int f_buffer_save(lua_State *L) {
+  Buffer *b = luaL_checkudata(L, 1, API_TYPE_BUFFER);
+  const char *filename = luaL_checkstring(L, 2);
+  int crlf = lua_toboolean(L, 3);
+  if (b->mapped) { return luaL_error(L, "buffer is read-only"); }
+
+  /* replace what a symlink points to, not the link */
+#ifdef _WIN32
+  const char *target = filename;
+#else
+  char *resolved = realpath(filename, NULL);
+  const char *target = resolved ? resolved : filename;
+#endif
+  char *path = NULL;
+  int fd = -1, ok, err;
+  int in_place = has_other_links(target);
+  if (!in_place) {
+    path = temp_path(target);
+    fd = path ? open_temp(path, target) : -1;
+    /* a directory we can't create files in may still hold a writable file */
+    in_place = fd < 0 && (errno == EACCES || errno == EPERM);
+  }
+  ok = fd >= 0;
+  err = errno;
+  if (in_place) {
+    ok = save_in_place(b, target, crlf);
+    err = errno;
+  } else if (ok && !write_lines(b, fd, crlf)) {
+    ok = 0;
+    err = errno;
+#ifdef _WIN32
+    _close(fd);
+#else
+    close(fd);
+#endif
+  } else if (ok && !commit_temp(fd, path, target)) {
+    ok = 0;
+    err = errno;
+  }
+  if (!ok && fd >= 0) { remove(path); }
+  free(path);
+#ifndef _WIN32
+  free(resolved);
+#endif
+
+  if (!ok) {
+    lua_pushnil(L);
+    lua_pushfstring(L, "%s: %s", filename, strerror(err));
+    return 2;
+  }
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+
+static int f_buffer_gc(lua_State *L) {
+  Buffer *b = luaL_checkudata(L, 1, API_TYPE_BUFFER);
+  close_file(b);
+  free(b->map_index);
+  free(b->map_block);
+  free(b->text);
+  free(b->lines);
+  return 0;
+}
+
+
+static int f_buffer_splice(lua_State *L) {
+  Buffer *b = luaL_checkudata(L, 1, API_TYPE_BUFFER);
+  if (b->mapped) { return luaL_error(L, "buffer is read-only"); }
+  size_t count = line_count(b);
+  lua_Integer at = luaL_checkinteger(L, 2);
+  lua_Integer remove = luaL_checkinteger(L, 3);
+  luaL_argcheck(L, at >= 1 && (size_t) at <= count + 1, 2, "line out of range");
+  luaL_argcheck(L, remove >= 0 && (size_t) (at - 1 + remove) <= count, 3, "count out of range");
+  size_t n = 0;
+  if (!lua_isnoneornil(L, 4)) {
+    luaL_checktype(L, 4, LUA_TTABLE);
+    n = lua_rawlen(L, 4);
+  }
+  move_gap(b, at - 1 + remove);
+  for (lua_Integer i = 0; i < remove; i++) {
+    b->live -= b->lines[--b->gap_start].len;
+  }
+  reserve_lines(L, b, n);
+  for (size_t i = 1; i <= n; i++) {
+    size_t len;
+    lua_rawgeti(L, 4, i);
+    const char *text = luaL_checklstring(L, -1, &len);
+    /* the line is counted before its text is stored: a compaction while
+    ** storing it must see every line already inserted */
+    b->lines[b->gap_start] = (Line) { 0, 0 };
+    b->gap_start++;
+    size_t offset = append_text(L, b, text, len);
+    b->lines[b->gap_start - 1] = (Line) { offset, len };
+    lua_pop(L, 1);
+  }
+  return 0;
+}
+
+
+static int f_buffer_get_memory(lua_State *L) {
+  Buffer *b = luaL_checkudata(L, 1, API_TYPE_BUFFER);
+  if (b->mapped) {
+    lua_pushnumber(L, (b->map_lines / MAP_INDEX_STRIDE + 1) * sizeof(size_t) + MAP_BLOCK_SIZE);
+    lua_pushnumber(L, b->map_len);
+    return 2;
+  }
+  lua_pushnumber(L, b->text_cap + b->cap * sizeof(Line));
+  lua_pushnumber(L, b->live);
+  return 2;
+}
+
+
+static int f_buffer_len(lua_State *L) {
+  Buffer *b = luaL_checkudata(L, 1, API_TYPE_BUFFER);
+  lua_pushinteger(L, line_count(b));
+  return 1;
+}
+
+
+/* returns the bytes of the file from offset to the end of the block holding
+** it, reading the block unless it is the last one read; none past the end */
+static const char *read_block(Buffer *b, size_t offset, size_t *len) {
+  if (offset < b->map_block_offset || offset >= b->map_block_offset + b->map_block_len) {
+    b->map_block_offset = offset - offset % MAP_BLOCK_SIZE;
+    b->map_block_len = read_file(b, b->map_block, MAP_BLOCK_SIZE, b->map_block_offset);
+    if (offset >= b->map_block_offset + b->map_block_len) { return NULL; }
+  }
+  *len = b->map_block_offset + b->map_block_len - offset;
+  return b->map_block + (offset - b->map_block_offset);
+}
+
+
+/* a line can span blocks, and so can its "\r\n"; if the file was truncated
+** since it was indexed, the lines past its end come out empty */
+static void push_mapped_line(lua_State *L, Buffer *b, size_t i) {
+  size_t offset = b->map_index[i / MAP_INDEX_STRIDE], len;
+  const char *p;
+  for (size_t n = i % MAP_INDEX_STRIDE; n > 0 && (p = read_block(b, offset, &len)); ) {
+    const char *nl = memchr(p, '\n', len);
+    if (nl) { len = nl - p + 1; n--; }
+    offset += len;
+  }
+  luaL_Buffer buf;
+  luaL_buffinit(L, &buf);
+  int cr = 0;
+  while ((p = read_block(b, offset, &len))) {
+    const char *nl = memchr(p, '\n', len);
+    size_t n = nl ? (size_t) (nl - p) : len;
+    /* a "\r" held back at the end of the last block */
+    if (cr && (n > 0 || !nl)) { luaL_addchar(&buf, '\r'); }
+    cr = n > 0 && p[n - 1] == '\r';
+    luaL_addlstring(&buf, p, cr ? n - 1 : n);
+    if (nl) { break; }
+    offset += len;
+  }
+  luaL_addchar(&buf, '\n');
+  luaL_pushresult(&buf);
+}
+
+
+static int push_line(lua_State *L, Buffer *b, lua_Integer i) {
+  if (i < 1 || (size_t) i > line_count(b)) { return 0; }
+  if (b->mapped) {
+    if (b->map_len == 0) {
+      lua_pushliteral(L, "\n");
+    } else {
+      push_mapped_line(L, b, i - 1);
+    }
+    return 1;
+  }
+  Line *line = get_line(b, i - 1);
+  lua_pushlstring(L, b->text + line->offset, line->len);
+  return 1;
+}
+
+
+static int f_buffer_index(lua_State *L) {
+  Buffer *b = luaL_checkudata(L, 1, API_TYPE_BUFFER);
+  if (lua_type(L, 2) == LUA_TNUMBER) {
+    if (!push_line(L, b, lua_tointeger(L, 2))) { lua_pushnil(L); }
+    return 1;
+  }
+  lua_pushvalue(L, 2);
+  lua_rawget(L, lua_upvalueindex(1));
+  return 1;
+}
+
+
+static int f_buffer_next(lua_State *L) {
+  Buffer *b = luaL_checkudata(L, 1, API_TYPE_BUFFER);
+  lua_Integer i = luaL_checkinteger(L, 2) + 1;
+  lua_pushinteger(L, i);
+  return push_line(L, b, i) ? 2 : 0;
+}
+
+
+static int f_buffer_ipairs(lua_State *L) {
+  luaL_checkudata(L, 1, API_TYPE_BUFFER);
+  lua_pushcfunction(L, f_buffer_next);
+  lua_pushvalue(L, 1);
+  lua_pushinteger(L, 0);
+  return 3;
+}
+
+
+static const luaL_Reg lib[] = {
+  { "new",        f_buffer_new        },
+  { "load",       f_buffer_load       },
+  { "map",        f_buffer_map        },
+  { "splice",     f_buffer_splice     },
+  { "save",       f_buffer_save       },
+  { "get_memory", f_buffer_get_memory },
+  { NULL,         NULL                }
+};
+
+static const luaL_Reg meta[] = {
+  { "__gc",       f_buffer_gc         },
+  { "__len",      f_buffer_len        },
+  { "__ipairs",   f_buffer_ipairs     },
+  { NULL,         NULL                }
+};
+
+int luaopen_buffer(lua_State *L) {
+  luaL_newlib(L, lib);
+  luaL_newmetatable(L, API_TYPE_BUFFER);
+  luaL_setfuncs(L, meta, 0);
+  /* numeric keys are lines, anything else is looked up in the library */
+  lua_pushvalue(L, -2);
+  lua_pushcclosure(L, f_buffer_index, 1);
+  lua_setfield(L, -2, "__index");
+  lua_pop(L, 1);
+  return 1;
+}
@@ -0,0 +1,252 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "api.h"
+
+/* an undo or redo stack of a document. Records are packed one after the
+** other in a single arena: a header, the integer arguments, the text, and
+** the record size again so the stack can be walked from the top. Pushing
+** appends, popping truncates, and once over its limits the journal drops
+** its oldest records from the front, which is reclaimed when the arena
+** needs room */
+
+#define JOURNAL_MIN_CAPACITY 4096
+
+enum { RECORD_INSERT, RECORD_REMOVE, RECORD_SELECTION };
+
+static const char *record_types[] = { "insert", "remove", "selection", NULL };
+
+typedef struct {
+  uint32_t size, type;
+  /* a merged record spans from the time of its first to its last edit */
+  double time, time_last;
+  uint32_t count, text_len;
+} RecordHeader;
+
+typedef struct {
+  unsigned char *data;
+  /* records live in data[start, len) */
+  size_t start, len, cap;
+  size_t count, max_records, max_bytes;
+  /* pushes minus pops, the change id of the document */
+  lua_Integer index;
+} Journal;
+
+
+static RecordHeader read_header(const Journal *j, size_t offset) {
+  RecordHeader h;
+  memcpy(&h, j->data + offset, sizeof(h));
+  return h;
+}
+
+
+static size_t top_offset(const Journal *j) {
+  uint32_t size;
+  memcpy(&size, j->data + j->len - sizeof(size), sizeof(size));
+  return j->len - size;
+}
+
+
+static int32_t read_int(const Journal *j, size_t offset, int i) {
+  int32_t v;
+  memcpy(&v, j->data + offset + sizeof(RecordHeader) + i * sizeof(v), sizeof(v));
+  return v;
+}
+
+
+static void reserve(lua_State *L, Journal *j, size_t n) {
+  size_t live = j->len - j->start + n;
+  /* an arena left mostly empty by pops and dropped records is shrunk, so
+  ** that one large edit doesn't pin its memory for the document's life */
+  int shrink = j->cap > JOURNAL_MIN_CAPACITY && live < j->cap / 4;
+  if (j->len + n <= j->cap && !shrink) { return; }
+  /* reclaim the space of dropped records first */
+  if (j->start > 0) {
+    memmove(j->data, j->data + j->start, j->len - j->start);
+    j->len -= j->start;
+    j->start = 0;
+    if (j->len + n <= j->cap && !shrink) { return; }
+  }
+  size_t cap = shrink ? live * 2 : j->cap * 2;
+  if (cap < JOURNAL_MIN_CAPACITY) { cap = JOURNAL_MIN_CAPACITY; }
+  if (cap < live) { cap = live; }
+  unsigned char *data = realloc(j->data, cap);
+  if (!data) {
+    if (shrink && j->len + n <= j->cap) { return; }
+    luaL_error(L, "journal allocation failed");
+  }
+  j->data = data;
+  j->cap = cap;
+}
+
+
+static void drop_oldest(Journal *j) {
+  while (j->count > 1 && (j->count > j->max_records || j->len - j->start > j->max_bytes)) {
+    j->start += read_header(j, j->start).size;
+    j->count--;
+  }
+}
+
+
+static int f_journal_new(lua_State *L) {
+  lua_Number max_records = luaL_checknumber(L, 1);
+  lua_Number max_bytes = luaL_checknumber(L, 2);
+  Journal *j = lua_newuserdata(L, sizeof(Journal));
+  memset(j, 0, sizeof(Journal));
+  j->max_records = max_records > 1 ? max_records : 1;
+  j->max_bytes = max_bytes > 0 ? max_bytes : 0;
+  j->index = 1;
+  luaL_setmetatable(L, API_TYPE_JOURNAL);
+  return 1;
+}
+
+
+static int f_journal_gc(lua_State *L) {
+  Journal *j = luaL_checkudata(L, 1, API_TYPE_JOURNAL);
+  free(j->data);
+  return 0;
+}
+
+
+static int f_journal_push(lua_State *L) {
+  Journal *j = luaL_checkudata(L, 1, API_TYPE_JOURNAL);
+  double time = luaL_checknumber(L, 2);
+  int type = luaL_checkoption(L, 3, NULL, record_types);
+  size_t text_len = 0;
+  const char *text = NULL;
+  int count = lua_gettop(L) - 3;
+  if (type == RECORD_INSERT) {
+    text = luaL_checklstring(L, 6, &text_len);
+    count = 2;
+  }
+  uint32_t size = sizeof(RecordHeader) + count * sizeof(int32_t) + text_len + sizeof(uint32_t);
+  reserve(L, j, size);
+
+  unsigned char *p = j->data + j->len;
+  RecordHeader h = { size, type, time, time, count, text_len };
+  memcpy(p, &h, sizeof(h));
+  p += sizeof(h);
+  for (int i = 0; i < count; i++) {
+    int32_t v = luaL_checkinteger(L, 4 + i);
+    memcpy(p, &v, sizeof(v));
+    p += sizeof(v);
+  }
+  if (text_len > 0) { memcpy(p, text, text_len); }
+  p += text_len;
+  memcpy(p, &size, sizeof(size));
+
+  j->len += size;
+  j->count++;
+  j->index++;
+  drop_oldest(j);
+  return 0;
+}
+
+
+/* returns the type and time of the record then its arguments */
+static int f_journal_pop(lua_State *L) {
+  Journal *j = luaL_checkudata(L, 1, API_TYPE_JOURNAL);
+  if (j->count == 0) { return 0; }
+  size_t offset = top_offset(j);
+  RecordHeader h = read_header(j, offset);
+  luaL_checkstack(L, h.count + 3, "too many values in undo record");
+  lua_pushstring(L, record_types[h.type]);
+  lua_pushnumber(L, h.time);
+  for (uint32_t i = 0; i < h.count; i++) {
+    lua_pushinteger(L, read_int(j, offset, i));
+  }
+  if (h.type == RECORD_INSERT) {
+    const char *text = (const char *) j->data + offset + sizeof(h) + h.count * sizeof(int32_t);
+    lua_pushlstring(L, text, h.text_len);
+  }
+  j->len = offset;
+  j->count--;
+  j->index--;
+  return h.count + 2 + (h.type == RECORD_INSERT);
+}
+
+
+static int f_journal_peek_time(lua_State *L) {
+  Journal *j = luaL_checkudata(L, 1, API_TYPE_JOURNAL);
+  if (j->count == 0) { return 0; }
+  lua_pushnumber(L, read_header(j, top_offset(j)).time_last);
+  return 1;
+}
+
+
+/* extends the "remove" record on top of the journal, which undoes an insert
+** on a single line, to also undo an insert right after it. Undoing both
+** inserts in one go is what the records would do anyway when pushed within
+** the merge timeout of each other */
+static int f_journal_merge_remove(lua_State *L) {
+  Journal *j = luaL_checkudata(L, 1, API_TYPE_JOURNAL);
+  lua_Integer line1 = luaL_checkinteger(L, 2), col1 = luaL_checkinteger(L, 3);
+  lua_Integer line2 = luaL_checkinteger(L, 4), col2 = luaL_checkinteger(L, 5);
+  double time = luaL_checknumber(L, 6);
+  double timeout = luaL_checknumber(L, 7);
+  int merged = 0;
+  if (j->count > 0 && line1 == line2) {
+    size_t offset = top_offset(j);
+    RecordHeader h = read_header(j, offset);
+    if (h.type == RECORD_REMOVE && time - h.time_last < timeout
+      && read_int(j, offset, 0) == line1 && read_int(j, offset, 2) == line1
+      && read_int(j, offset, 3) == col1) {
+      int32_t v = col2;
+      memcpy(j->data + offset + sizeof(h) + 3 * sizeof(v), &v, sizeof(v));
+      h.time_last = time;
+      memcpy(j->data + offset, &h, sizeof(h));
+      merged = 1;
+    }
+  }
+  lua_pushboolean(L, merged);
+  return 1;
+}
+
+
+static int f_journal_clear(lua_State *L) {
+  Journal *j = luaL_checkudata(L, 1, API_TYPE_JOURNAL);
+  free(j->data);
+  j->data = NULL;
+  j->start = j->len = j->cap = j->count = 0;
+  j->index = 1;
+  return 0;
+}
+
+
+static int f_journal_get_index(lua_State *L) {
+  Journal *j = luaL_checkudata(L, 1, API_TYPE_JOURNAL);
+  lua_pushinteger(L, j->index);
+  return 1;
+}
+
+
+static int f_journal_get_memory(lua_State *L) {
+  Journal *j = luaL_checkudata(L, 1, API_TYPE_JOURNAL);
+  lua_pushnumber(L, j->len - j->start);
+  lua_pushnumber(L, j->count);
+  return 2;
+}
+
+
+static const luaL_Reg lib[] = {
+  { "new",          f_journal_new          },
+  { "push",         f_journal_push         },
+  { "pop",          f_journal_pop          },
+  { "peek_time",    f_journal_peek_time    },
+  { "merge_remove", f_journal_merge_remove },
+  { "clear",        f_journal_clear        },
+  { "get_index",    f_journal_get_index    },
+  { "get_memory",   f_journal_get_memory   },
+  { NULL,           NULL                   }
+};
+
+int luaopen_journal(lua_State *L) {
+  luaL_newlib(L, lib);
+  luaL_newmetatable(L, API_TYPE_JOURNAL);
+  lua_pushvalue(L, -2);
+  lua_setfield(L, -2, "__index");
+  lua_pushcfunction(L, f_journal_gc);
+  lua_setfield(L, -2, "__gc");
+  lua_pop(L, 1);
+  return 1;
+}
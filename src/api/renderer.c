@@ -6,7 +6,7 @@ static int f_font_load(lua_State *L) {
   const char *filename  = luaL_checkstring(L, 1);
   float size = luaL_checknumber(L, 2);
   unsigned int font_hinting = FONT_HINTING_SLIGHT, font_style = 0;
-  bool subpixel = true;
+  bool subpixel = true, async = false;
   if (lua_gettop(L) > 2 && lua_istable(L, 3)) {
     lua_getfield(L, 3, "antialiasing");
     if (lua_isstring(L, -1)) {
@@ -45,10 +45,15 @@ static int f_font_load(lua_State *L) {
     lua_getfield(L, 3, "underline");
     if (lua_toboolean(L, -1))
       font_style |= FONT_STYLE_UNDERLINE;
-    lua_pop(L, 5);
+    lua_getfield(L, 3, "async");
+    async = lua_toboolean(L, -1);
+    lua_pop(L, 6);
   }
   RenFont** font = lua_newuserdata(L, sizeof(RenFont*));
-  *font = ren_font_load(filename, size, subpixel, font_hinting, font_style);
+  if (async)
+    *font = ren_font_load_async(filename, size, subpixel, font_hinting, font_style);
+  else
+    *font = ren_font_load(filename, size, subpixel, font_hinting, font_style);
   if (!*font)
     return luaL_error(L, "failed to load font");
   luaL_setmetatable(L, API_TYPE_FONT);
@@ -58,8 +63,14 @@ static int f_font_load(lua_State *L) {
 static int f_font_copy(lua_State *L) {
   RenFont** self = luaL_checkudata(L, 1, API_TYPE_FONT);
   float size = lua_gettop(L) >= 2 ? luaL_checknumber(L, 2) : ren_font_get_height(*self);
+  bool async = false;
+  if (lua_gettop(L) > 2 && lua_istable(L, 3)) {
+    lua_getfield(L, 3, "async");
+    async = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+  }
   RenFont** font = lua_newuserdata(L, sizeof(RenFont*));
-  *font = ren_font_copy(*self, size);
+  *font = ren_font_copy(*self, size, async);
   if (!*font)
     return luaL_error(L, "failed to copy font");
   luaL_setmetatable(L, API_TYPE_FONT);
@@ -85,6 +96,22 @@ static int f_font_get_width(lua_State *L) {
   return 1;
 }
 
+static int f_font_get_offsets(lua_State *L) {
+  RenFont** self = luaL_checkudata(L, 1, API_TYPE_FONT);
+  size_t len;
+  const char *text = luaL_checklstring(L, 2, &len);
+  float *offsets = malloc(sizeof(float) * (len + 1));
+  if (!offsets) { luaL_error(L, "buffer allocation failed"); }
+  ren_font_get_offsets(*self, text, len, offsets);
+  lua_createtable(L, len + 1, 0);
+  for (size_t i = 0; i <= len; i++) {
+    lua_pushnumber(L, offsets[i]);
+    lua_rawseti(L, -2, i + 1);
+  }
+  free(offsets);
+  return 1;
+}
+
 static int f_font_get_height(lua_State *L) {
   RenFont** self = luaL_checkudata(L, 1, API_TYPE_FONT);
   lua_pushnumber(L, ren_font_get_height(*self));
@@ -122,6 +149,99 @@ static int f_show_debug(lua_State *L) {
 }
 
 
+static int f_set_render_threads(lua_State *L) {
+  rencache_set_render_threads(luaL_checknumber(L, 1));
+  return 0;
+}
+
+
+static int f_set_glyph_cache_limit(lua_State *L) {
+  lua_Number bytes = luaL_checknumber(L, 1);
+  ren_set_glyph_cache_limit(bytes > 0 ? bytes : 0);
+  return 0;
+}
+
+
+static int f_set_double_buffer(lua_State *L) {
+  luaL_checkany(L, 1);
+  ren_set_double_buffer(lua_toboolean(L, 1));
+  return 0;
+}
+
+
+static int f_get_glyph_stats(lua_State *L) {
+  RenGlyphStats stats;
+  ren_get_glyph_stats(&stats);
+  lua_pushnumber(L, stats.measured);
+  lua_pushnumber(L, stats.rasterized);
+  lua_pushnumber(L, stats.evicted);
+  lua_pushnumber(L, stats.cache_size);
+  return 4;
+}
+
+
+static int f_get_layout_stats(lua_State *L) {
+  RenLayoutStats stats;
+  ren_get_layout_stats(&stats);
+  lua_pushnumber(L, stats.hits);
+  lua_pushnumber(L, stats.misses);
+  lua_pushnumber(L, stats.evicted);
+  lua_pushnumber(L, stats.cache_size);
+  return 4;
+}
+
+
+static int f_get_frame_stats(lua_State *L) {
+  RenFrameStats stats;
+  rencache_get_frame_stats(&stats);
+  lua_createtable(L, 0, 14);
+  lua_pushnumber(L, stats.events);       lua_setfield(L, -2, "events");
+  lua_pushnumber(L, stats.update);       lua_setfield(L, -2, "update");
+  lua_pushnumber(L, stats.draw);         lua_setfield(L, -2, "draw");
+  lua_pushnumber(L, stats.hash);         lua_setfield(L, -2, "hash");
+  lua_pushnumber(L, stats.replay);       lua_setfield(L, -2, "replay");
+  lua_pushnumber(L, stats.present);      lua_setfield(L, -2, "present");
+  lua_pushinteger(L, stats.commands);    lua_setfield(L, -2, "commands");
+  lua_pushinteger(L, stats.rects);       lua_setfield(L, -2, "rects");
+  lua_pushinteger(L, stats.pixels);      lua_setfield(L, -2, "pixels");
+  lua_pushinteger(L, stats.changed_cells); lua_setfield(L, -2, "changed_cells");
+  lua_pushinteger(L, stats.redrawn_cells); lua_setfield(L, -2, "redrawn_cells");
+  lua_pushnumber(L, stats.redrawn_cells > 0 ? (double) stats.changed_cells / stats.redrawn_cells : 1);
+  lua_setfield(L, -2, "efficiency");
+  lua_pushinteger(L, stats.glyph_misses); lua_setfield(L, -2, "glyph_misses");
+  lua_pushinteger(L, stats.uploaded);    lua_setfield(L, -2, "uploaded");
+  return 1;
+}
+
+
+static int f_get_input_latency(lua_State *L) {
+  RenLatencyStats stats;
+  rencache_get_input_latency(&stats);
+  lua_pushinteger(L, stats.count);
+  lua_pushnumber(L, stats.p50);
+  lua_pushnumber(L, stats.p99);
+  lua_pushnumber(L, stats.max);
+  lua_pushnumber(L, stats.mean);
+  return 5;
+}
+
+
+static int f_reset_input_latency(lua_State *L) {
+  rencache_reset_input_latency();
+  return 0;
+}
+
+
+static int f_get_command_buffer_stats(lua_State *L) {
+  size_t last_frame, capacity, high_water;
+  rencache_get_command_buffer_stats(&last_frame, &capacity, &high_water);
+  lua_pushnumber(L, last_frame);
+  lua_pushnumber(L, capacity);
+  lua_pushnumber(L, high_water);
+  return 3;
+}
+
+
 static int f_get_size(lua_State *L) {
   int w, h;
   ren_get_size(&w, &h);
@@ -132,6 +252,7 @@ static int f_get_size(lua_State *L) {
 
 
 static int f_begin_frame(lua_State *L) {
+  rencache_set_frame_times(luaL_optnumber(L, 1, 0), luaL_optnumber(L, 2, 0));
   rencache_begin_frame(L);
   return 0;
 }
@@ -165,6 +286,17 @@ static int f_draw_rect(lua_State *L) {
   return 0;
 }
 
+static int f_scroll_region(lua_State *L) {
+  RenRect rect;
+  rect.x = luaL_checknumber(L, 1);
+  rect.y = luaL_checknumber(L, 2);
+  rect.width = luaL_checknumber(L, 3);
+  rect.height = luaL_checknumber(L, 4);
+  int dy = luaL_checknumber(L, 5);
+  rencache_scroll_region(rect, dy);
+  return 0;
+}
+
 static int f_draw_text(lua_State *L) {
   RenFont** font = luaL_checkudata(L, 1, API_TYPE_FONT);
   const char *text = luaL_checkstring(L, 2);
@@ -176,14 +308,104 @@ static int f_draw_text(lua_State *L) {
   return 1;
 }
 
+/* fonts and colors resolved for a token type, token types being interned
+   strings they are told apart by address */
+typedef struct {
+  const char *type;
+  RenFont *font;
+  RenColor color;
+} TokenStyle;
+
+#define TOKEN_STYLES_CACHED 16
+
+static RenFont *checkfontmap(lua_State *L, int idx, int type_idx) {
+  if (!lua_istable(L, idx)) {
+    return *(RenFont**) luaL_checkudata(L, idx, API_TYPE_FONT);
+  }
+  lua_pushvalue(L, type_idx);
+  lua_gettable(L, idx);
+  RenFont **font = luaL_testudata(L, -1, API_TYPE_FONT);
+  if (!font) {
+    luaL_error(L, "no font for token type '%s'", lua_tostring(L, type_idx));
+  }
+  lua_pop(L, 1);
+  return *font;
+}
+
+static int f_draw_tokens(lua_State *L) {
+  static RenTextSpan *spans;
+  static int spans_capacity;
+  luaL_checktype(L, 2, LUA_TTABLE);
+  float x = luaL_checknumber(L, 3);
+  int y = luaL_checknumber(L, 4);
+  luaL_checktype(L, 5, LUA_TTABLE);
+  if (!lua_istable(L, 1)) {
+    luaL_checkudata(L, 1, API_TYPE_FONT);
+  }
+
+  int count = lua_rawlen(L, 2) / 2;
+  if (count > spans_capacity) {
+    RenTextSpan *new_spans = realloc(spans, count * sizeof(RenTextSpan));
+    if (!new_spans) {
+      return luaL_error(L, "unable to allocate token spans");
+    }
+    spans = new_spans;
+    spans_capacity = count;
+  }
+
+  /* the token texts stay referenced by the tokens table during the call */
+  TokenStyle styles[TOKEN_STYLES_CACHED];
+  int styles_count = 0;
+  for (int i = 0; i < count; i++) {
+    lua_rawgeti(L, 2, i * 2 + 1);
+    lua_rawgeti(L, 2, i * 2 + 2);
+    const char *type = luaL_checkstring(L, -2);
+    RenTextSpan *span = &spans[i];
+    span->text = luaL_checklstring(L, -1, &span->len);
+    int s = 0;
+    while (s < styles_count && styles[s].type != type) { s++; }
+    if (s == styles_count) {
+      TokenStyle style = { type, checkfontmap(L, 1, lua_gettop(L) - 1) };
+      lua_pushvalue(L, -2);
+      lua_gettable(L, 5);
+      style.color = checkcolor(L, lua_gettop(L), 255);
+      lua_pop(L, 1);
+      if (styles_count < TOKEN_STYLES_CACHED) {
+        styles[styles_count++] = style;
+      } else {
+        s = TOKEN_STYLES_CACHED - 1;
+        styles[s] = style;
+      }
+    }
+    span->font = styles[s].font;
+    span->color = styles[s].color;
+    lua_pop(L, 2);
+  }
+
+  x = rencache_draw_tokens(L, spans, count, x, y);
+  lua_pushnumber(L, x);
+  return 1;
+}
+
 static const luaL_Reg lib[] = {
   { "show_debug",         f_show_debug         },
   { "get_size",           f_get_size           },
+  { "get_command_buffer_stats", f_get_command_buffer_stats },
+  { "set_render_threads", f_set_render_threads },
+  { "set_glyph_cache_limit", f_set_glyph_cache_limit },
+  { "set_double_buffer",  f_set_double_buffer  },
+  { "get_glyph_stats",    f_get_glyph_stats    },
+  { "get_layout_stats",   f_get_layout_stats   },
+  { "get_frame_stats",    f_get_frame_stats    },
+  { "get_input_latency",  f_get_input_latency  },
+  { "reset_input_latency", f_reset_input_latency },
   { "begin_frame",        f_begin_frame        },
   { "end_frame",          f_end_frame          },
   { "set_clip_rect",      f_set_clip_rect      },
   { "draw_rect",          f_draw_rect          },
+  { "scroll_region",      f_scroll_region      },
   { "draw_text",          f_draw_text          },
+  { "draw_tokens",        f_draw_tokens        },
   { NULL,                 NULL                 }
 };
 
@@ -193,6 +415,7 @@ static const luaL_Reg fontLib[] = {
   { "copy",               f_font_copy               },
   { "set_tab_size",       f_font_set_tab_size       },
   { "get_width",          f_font_get_width          },
+  { "get_offsets",        f_font_get_offsets        },
   { "get_height",         f_font_get_height         },
   { "get_size",           f_font_get_size           },
   { NULL, NULL }
@@ -175,6 +175,7 @@ top:
         SDL_FlushEvent(SDL_QUIT);
       }
 #endif
+      rencache_input_event(e.key.timestamp);
       lua_pushstring(L, "keypressed");
       lua_pushstring(L, get_key_name(&e, buf));
       return 2;
@@ -237,6 +238,13 @@ top:
       return 2;
 
     default:
+      /* a font loaded in the background is ready, redraw the text laid
+      ** out with it so far */
+      if (e.type == ren_font_loaded_event()) {
+        rencache_invalidate();
+        lua_pushstring(L, "fontloaded");
+        return 1;
+      }
       goto top;
   }
 
@@ -330,7 +338,7 @@ static int f_set_window_hit_test(lua_State *L) {
 
 
 static int f_get_window_size(lua_State *L) {
-  int x, y, w, h;
+  int x = 0, y = 0, w = 0, h = 0;
   SDL_GetWindowSize(window, &w, &h);
   SDL_GetWindowPosition(window, &x, &y);
   lua_pushnumber(L, w);
@@ -360,6 +368,75 @@ static int f_window_has_focus(lua_State *L) {
 }
 
 
+static int f_get_refresh_rate(lua_State *L) {
+  SDL_DisplayMode mode;
+  int display = SDL_GetWindowDisplayIndex(window);
+  if (display < 0 || SDL_GetCurrentDisplayMode(display, &mode) != 0 || mode.refresh_rate <= 0)
+    return 0;
+  lua_pushinteger(L, mode.refresh_rate);
+  return 1;
+}
+
+
+/* synthetic typing for benchmarks: a timer thread pushes the events a
+** keyboard would for every character, so that their timestamps go through
+** the same queue, frame pacing and present as real keypresses */
+static SDL_atomic_t typing;
+static char *typing_text;
+static size_t typing_pos;
+
+static Uint32 SDLCALL type_next_key(Uint32 interval, void *data) {
+  const char *p = typing_text + typing_pos;
+  if (!*p) {
+    SDL_free(typing_text);
+    typing_text = NULL;
+    SDL_AtomicSet(&typing, 0);
+    return 0;
+  }
+  unsigned char c = *p;
+  size_t len = 1;
+  while (len < 4 && (p[len] & 0xc0) == 0x80) { len++; }
+  SDL_Event e;
+  SDL_zero(e);
+  e.key.keysym.sym = c == '\n' ? SDLK_RETURN : c < 0x80 ? tolower(c) : SDLK_UNKNOWN;
+  e.key.keysym.scancode = SDL_GetScancodeFromKey(e.key.keysym.sym);
+  e.type = SDL_KEYDOWN;
+  e.key.state = SDL_PRESSED;
+  SDL_PushEvent(&e);
+  e.type = SDL_KEYUP;
+  e.key.state = SDL_RELEASED;
+  SDL_PushEvent(&e);
+  if (c != '\n') {
+    SDL_zero(e);
+    e.type = SDL_TEXTINPUT;
+    memcpy(e.text.text, p, len);
+    SDL_PushEvent(&e);
+  }
+  typing_pos += len;
+  return interval;
+}
+
+
+static int f_type_text(lua_State *L) {
+  const char *text = luaL_checkstring(L, 1);
+  double interval = luaL_checknumber(L, 2);
+  if (window) { return luaL_error(L, "synthetic typing is only available headless"); }
+  if (SDL_AtomicGet(&typing)) { return luaL_error(L, "already typing"); }
+  /* text input events are only enabled by the video subsystem */
+  SDL_EventState(SDL_TEXTINPUT, SDL_ENABLE);
+  typing_text = SDL_strdup(text);
+  typing_pos = 0;
+  SDL_AtomicSet(&typing, 1);
+  if (!SDL_AddTimer(interval > 0.001 ? interval * 1000 : 1, type_next_key, NULL)) {
+    SDL_free(typing_text);
+    typing_text = NULL;
+    SDL_AtomicSet(&typing, 0);
+    return luaL_error(L, "cannot start typing: %s", SDL_GetError());
+  }
+  return 0;
+}
+
+
 static int f_get_window_mode(lua_State *L) {
   unsigned flags = SDL_GetWindowFlags(window);
   if (flags & SDL_WINDOW_FULLSCREEN_DESKTOP) {
@@ -744,6 +821,8 @@ static const luaL_Reg lib[] = {
   { "get_window_size",     f_get_window_size     },
   { "set_window_size",     f_set_window_size     },
   { "window_has_focus",    f_window_has_focus    },
+  { "get_refresh_rate",    f_get_refresh_rate    },
+  { "type_text",           f_type_text           },
   { "show_fatal_error",    f_show_fatal_error    },
   { "rmdir",               f_rmdir               },
   { "chdir",               f_chdir               },
@@ -0,0 +1,150 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <SDL.h>
+#include "fileindex.h"
+
+/* the text is split into chunks starting at line starts, so that no line
+** and no UTF-8 sequence crosses two chunks. A first pass counts the lines
+** and checks the content of every chunk; once the first line number of each
+** chunk is known, a second pass records the offsets */
+
+#define FILE_INDEX_MAX_THREADS 8
+#define FILE_INDEX_CHUNK_MIN (1024 * 1024)
+
+typedef struct {
+  const char *text;
+  size_t start, end;
+  size_t stride, first_line;
+  size_t lines, lf, crlf;
+  bool utf8, binary;
+  size_t *offsets;
+} IndexChunk;
+
+
+static bool valid_utf8(const unsigned char *p, const unsigned char *end) {
+  while (p < end) {
+    /* skip ASCII eight bytes at a time */
+    if (end - p >= 8) {
+      uint64_t v;
+      memcpy(&v, p, 8);
+      if (!(v & 0x8080808080808080ull)) { p += 8; continue; }
+    }
+    unsigned c = *p;
+    if (c < 0x80) { p++; continue; }
+    int n;
+    unsigned min;
+    if (c >= 0xc2 && c <= 0xdf) { n = 1; min = 0x80; }
+    else if ((c & 0xf0) == 0xe0) { n = 2; min = 0x800; }
+    else if (c >= 0xf0 && c <= 0xf4) { n = 3; min = 0x10000; }
+    else { return false; }
+    if (end - p <= n) { return false; }
+    unsigned cp = c & (0x3f >> n);
+    for (int i = 1; i <= n; i++) {
+      if ((p[i] & 0xc0) != 0x80) { return false; }
+      cp = (cp << 6) | (p[i] & 0x3f);
+    }
+    if (cp < min || cp > 0x10ffff || (cp >= 0xd800 && cp <= 0xdfff)) { return false; }
+    p += n + 1;
+  }
+  return true;
+}
+
+
+static int scan_chunk(void *data) {
+  IndexChunk *chunk = data;
+  const char *p = chunk->text + chunk->start, *end = chunk->text + chunk->end;
+  chunk->binary = memchr(p, '\0', end - p) != NULL;
+  chunk->utf8 = valid_utf8((const unsigned char *) p, (const unsigned char *) end);
+  while (p < end) {
+    chunk->lines++;
+    const char *nl = memchr(p, '\n', end - p);
+    if (!nl) { break; }
+    if (nl > p && nl[-1] == '\r') { chunk->crlf++; } else { chunk->lf++; }
+    p = nl + 1;
+  }
+  return 0;
+}
+
+
+static int record_offsets(void *data) {
+  IndexChunk *chunk = data;
+  const char *p = chunk->text + chunk->start, *end = chunk->text + chunk->end;
+  /* skip to the first line of the chunk that falls on the stride */
+  size_t skip = (chunk->stride - chunk->first_line % chunk->stride) % chunk->stride;
+  size_t line = chunk->first_line;
+  while (p < end) {
+    if (skip == 0) {
+      chunk->offsets[line / chunk->stride] = p - chunk->text;
+      skip = chunk->stride;
+    }
+    skip--;
+    line++;
+    const char *nl = memchr(p, '\n', end - p);
+    if (!nl) { break; }
+    p = nl + 1;
+  }
+  return 0;
+}
+
+
+static void run_chunks(IndexChunk *chunks, int count, SDL_ThreadFunction fn) {
+  SDL_Thread *threads[FILE_INDEX_MAX_THREADS];
+  for (int i = 1; i < count; i++) {
+    threads[i] = SDL_CreateThread(fn, "file_index", &chunks[i]);
+  }
+  fn(&chunks[0]);
+  for (int i = 1; i < count; i++) {
+    /* without a thread the chunk is scanned here */
+    if (threads[i]) { SDL_WaitThread(threads[i], NULL); } else { fn(&chunks[i]); }
+  }
+}
+
+
+bool file_index(const char *text, size_t len, size_t stride, FileIndex *index) {
+  IndexChunk chunks[FILE_INDEX_MAX_THREADS];
+  int count = SDL_GetCPUCount();
+  if (count > FILE_INDEX_MAX_THREADS) { count = FILE_INDEX_MAX_THREADS; }
+  if ((size_t) count > len / FILE_INDEX_CHUNK_MIN) { count = len / FILE_INDEX_CHUNK_MIN; }
+  if (count < 1) { count = 1; }
+
+  size_t start = 0;
+  for (int i = 0; i < count; i++) {
+    size_t end = len;
+    if (i < count - 1) {
+      const char *nl = memchr(text + len / count * (i + 1), '\n', len - len / count * (i + 1));
+      end = nl ? (size_t) (nl - text) + 1 : len;
+      if (end < start) { end = start; }
+    }
+    chunks[i] = (IndexChunk) { .text = text, .start = start, .end = end, .stride = stride };
+    start = end;
+  }
+  run_chunks(chunks, count, scan_chunk);
+
+  memset(index, 0, sizeof(*index));
+  index->utf8 = true;
+  for (int i = 0; i < count; i++) {
+    chunks[i].first_line = index->lines;
+    index->lines += chunks[i].lines;
+    index->lf += chunks[i].lf;
+    index->crlf += chunks[i].crlf;
+    index->utf8 = index->utf8 && chunks[i].utf8;
+    index->binary = index->binary || chunks[i].binary;
+  }
+
+  if (stride > 0) {
+    index->offsets = malloc((index->lines / stride + 1) * sizeof(size_t));
+    if (!index->offsets) { return false; }
+    for (int i = 0; i < count; i++) { chunks[i].offsets = index->offsets; }
+    run_chunks(chunks, count, record_offsets);
+  }
+  return true;
+}
+
+
+const char *file_index_endings(const FileIndex *index) {
+  if (index->crlf && index->lf) { return "mixed"; }
+  if (index->crlf) { return "crlf"; }
+  if (index->lf) { return "lf"; }
+  return "none";
+}
@@ -0,0 +1,22 @@
+#ifndef FILEINDEX_H
+#define FILEINDEX_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct {
+  /* lines, counting a last line without newline; newlines by kind */
+  size_t lines, lf, crlf;
+  bool utf8, binary;
+  /* byte offset of every stride-th line, when a stride was given */
+  size_t *offsets;
+} FileIndex;
+
+/* scans text in chunks on several threads if it is large enough. With a
+** stride of 0 no offsets are kept. Returns false if out of memory */
+bool file_index(const char *text, size_t len, size_t stride, FileIndex *index);
+
+/* "lf", "crlf", "mixed" or "none", from the newlines counted */
+const char *file_index_endings(const FileIndex *index);
+
+#endif
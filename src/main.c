@@ -92,7 +92,16 @@ int main(int argc, char **argv) {
   signal(SIGPIPE, SIG_IGN);
 #endif
 
-  SDL_Init(SDL_INIT_VIDEO | SDL_INIT_EVENTS);
+  /* LITE_XL_HEADLESS=<width>x<height> draws frames in memory only, without
+  ** a window or a video driver, e.g. to time the renderer on a CI machine */
+  int headless_w = 0, headless_h = 0;
+  const char *headless = getenv("LITE_XL_HEADLESS");
+  if (headless && (sscanf(headless, "%dx%d", &headless_w, &headless_h) != 2 || headless_w <= 0 || headless_h <= 0)) {
+    fprintf(stderr, "Warning: ignoring invalid LITE_XL_HEADLESS size \"%s\"\n", headless);
+    headless = NULL;
+  }
+
+  SDL_Init((headless ? 0 : SDL_INIT_VIDEO) | SDL_INIT_EVENTS);
   SDL_EnableScreenSaver();
   SDL_EventState(SDL_DROPFILE, SDL_ENABLE);
   atexit(SDL_Quit);
@@ -104,14 +113,18 @@ int main(int argc, char **argv) {
   SDL_SetHint(SDL_HINT_MOUSE_FOCUS_CLICKTHROUGH, "1");
 #endif
 
-  SDL_DisplayMode dm;
-  SDL_GetCurrentDisplayMode(0, &dm);
-
-  window = SDL_CreateWindow(
-    "", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, dm.w * 0.8, dm.h * 0.8,
-    SDL_WINDOW_RESIZABLE | SDL_WINDOW_ALLOW_HIGHDPI | SDL_WINDOW_HIDDEN);
-  init_window_icon();
-  ren_init(window);
+  if (headless) {
+    ren_init_headless(headless_w, headless_h);
+  } else {
+    SDL_DisplayMode dm;
+    SDL_GetCurrentDisplayMode(0, &dm);
+
+    window = SDL_CreateWindow(
+      "", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, dm.w * 0.8, dm.h * 0.8,
+      SDL_WINDOW_RESIZABLE | SDL_WINDOW_ALLOW_HIGHDPI | SDL_WINDOW_HIDDEN);
+    init_window_icon();
+    ren_init(window);
+  }
 
   lua_State *L;
 init_lua:
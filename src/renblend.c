@@ -0,0 +1,268 @@
+#include <string.h>
+#include <SDL.h>
+#include "renblend.h"
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__)
+  #define BLEND_X86
+  #include <immintrin.h>
+  #define TARGET_SSE2 __attribute__((target("sse2")))
+  #define TARGET_AVX2 __attribute__((target("avx2")))
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+  #define BLEND_NEON
+  #include <arm_neon.h>
+#endif
+
+#define DIVIDE_BY_255_SIGNED(x, sign_val)  (((x) + (sign_val) + ((x)>>8)) >> 8)
+#define DIVIDE_BY_255(x)    DIVIDE_BY_255_SIGNED(x, 1)
+
+/* Vector kernels work on 16 bit lanes laid out like the destination bytes:
+   B, G, R, A. Glyph blending computes
+     (color * coverage + dst * (255 - coverage) + 127) / 255
+   per lane; the alpha lane gets a coverage of 0 which gives back dst exactly.
+   Rect blending computes (color * a + dst * (255 - a)) >> 8 per lane with a
+   weight of 256 for the alpha lane, again giving back dst exactly. */
+
+/************************* Scalar *************************/
+
+static void glyph_gray_scalar(uint32_t *dst, const uint8_t *src, int count, RenColor color) {
+  for (int x = 0; x < count; ++x) {
+    uint32_t d = dst[x];
+    unsigned int intensity = src[x], r, g, b;
+    r = color.r * intensity + ((d >> 16) & 0xFF) * (255 - intensity) + 127;
+    r = DIVIDE_BY_255(r);
+    g = color.g * intensity + ((d >> 8) & 0xFF) * (255 - intensity) + 127;
+    g = DIVIDE_BY_255(g);
+    b = color.b * intensity + (d & 0xFF) * (255 - intensity) + 127;
+    b = DIVIDE_BY_255(b);
+    dst[x] = (d & 0xFF000000) | r << 16 | g << 8 | b;
+  }
+}
+
+static void glyph_subpixel_scalar(uint32_t *dst, const uint8_t *src, int count, RenColor color) {
+  for (int x = 0; x < count; ++x, src += 3) {
+    uint32_t d = dst[x];
+    unsigned int r, g, b;
+    r = color.r * src[0] + ((d >> 16) & 0xFF) * (255 - src[0]) + 127;
+    r = DIVIDE_BY_255(r);
+    g = color.g * src[1] + ((d >> 8) & 0xFF) * (255 - src[1]) + 127;
+    g = DIVIDE_BY_255(g);
+    b = color.b * src[2] + (d & 0xFF) * (255 - src[2]) + 127;
+    b = DIVIDE_BY_255(b);
+    dst[x] = (d & 0xFF000000) | r << 16 | g << 8 | b;
+  }
+}
+
+static void rect_scalar(RenColor *dst, int count, RenColor color) {
+  int ia = 0xff - color.a;
+  for (int x = 0; x < count; ++x) {
+    dst[x].r = ((color.r * color.a) + (dst[x].r * ia)) >> 8;
+    dst[x].g = ((color.g * color.a) + (dst[x].g * ia)) >> 8;
+    dst[x].b = ((color.b * color.a) + (dst[x].b * ia)) >> 8;
+  }
+}
+
+/* coverage of one pixel spread in the B, G, R bytes, 0 in the alpha byte */
+static inline uint32_t subpixel_coverage(const uint8_t *src) {
+  return src[2] | src[1] << 8 | (uint32_t) src[0] << 16;
+}
+
+#ifdef BLEND_X86
+/************************* SSE2 *************************/
+
+TARGET_SSE2 static inline __m128i glyph_lanes_sse2(__m128i d, __m128i cov, __m128i col) {
+  __m128i x = _mm_add_epi16(_mm_mullo_epi16(col, cov),
+    _mm_mullo_epi16(d, _mm_sub_epi16(_mm_set1_epi16(255), cov)));
+  x = _mm_add_epi16(x, _mm_set1_epi16(127));
+  x = _mm_add_epi16(_mm_add_epi16(x, _mm_set1_epi16(1)), _mm_srli_epi16(x, 8));
+  return _mm_srli_epi16(x, 8);
+}
+
+TARGET_SSE2 static inline void glyph_blend4_sse2(uint32_t *dst, __m128i cov, __m128i col) {
+  const __m128i zero = _mm_setzero_si128();
+  __m128i d = _mm_loadu_si128((const __m128i*) dst);
+  __m128i lo = glyph_lanes_sse2(_mm_unpacklo_epi8(d, zero), _mm_unpacklo_epi8(cov, zero), col);
+  __m128i hi = glyph_lanes_sse2(_mm_unpackhi_epi8(d, zero), _mm_unpackhi_epi8(cov, zero), col);
+  _mm_storeu_si128((__m128i*) dst, _mm_packus_epi16(lo, hi));
+}
+
+TARGET_SSE2 static void glyph_gray_sse2(uint32_t *dst, const uint8_t *src, int count, RenColor color) {
+  const __m128i col = _mm_set_epi16(0, color.r, color.g, color.b, 0, color.r, color.g, color.b);
+  const __m128i rgb_mask = _mm_set1_epi32(0x00FFFFFF);
+  int x = 0;
+  for (; x + 4 <= count; x += 4) {
+    int32_t coverage;
+    memcpy(&coverage, src + x, 4);
+    __m128i cov = _mm_cvtsi32_si128(coverage);
+    cov = _mm_unpacklo_epi8(cov, cov);
+    cov = _mm_and_si128(_mm_unpacklo_epi16(cov, cov), rgb_mask);
+    glyph_blend4_sse2(dst + x, cov, col);
+  }
+  glyph_gray_scalar(dst + x, src + x, count - x, color);
+}
+
+TARGET_SSE2 static void glyph_subpixel_sse2(uint32_t *dst, const uint8_t *src, int count, RenColor color) {
+  const __m128i col = _mm_set_epi16(0, color.r, color.g, color.b, 0, color.r, color.g, color.b);
+  int x = 0;
+  for (; x + 4 <= count; x += 4) {
+    const uint8_t *s = src + x * 3;
+    __m128i cov = _mm_set_epi32(subpixel_coverage(s + 9), subpixel_coverage(s + 6),
+      subpixel_coverage(s + 3), subpixel_coverage(s));
+    glyph_blend4_sse2(dst + x, cov, col);
+  }
+  glyph_subpixel_scalar(dst + x, src + x * 3, count - x, color);
+}
+
+TARGET_SSE2 static void rect_sse2(RenColor *dst, int count, RenColor color) {
+  const __m128i zero = _mm_setzero_si128();
+  const int a = color.a, ia = 0xff - a;
+  const __m128i src = _mm_set_epi16(0, color.r * a, color.g * a, color.b * a, 0, color.r * a, color.g * a, color.b * a);
+  const __m128i weight = _mm_set_epi16(256, ia, ia, ia, 256, ia, ia, ia);
+  int x = 0;
+  for (; x + 4 <= count; x += 4) {
+    __m128i d = _mm_loadu_si128((const __m128i*) (dst + x));
+    __m128i lo = _mm_srli_epi16(_mm_add_epi16(src, _mm_mullo_epi16(_mm_unpacklo_epi8(d, zero), weight)), 8);
+    __m128i hi = _mm_srli_epi16(_mm_add_epi16(src, _mm_mullo_epi16(_mm_unpackhi_epi8(d, zero), weight)), 8);
+    _mm_storeu_si128((__m128i*) (dst + x), _mm_packus_epi16(lo, hi));
+  }
+  rect_scalar(dst + x, count - x, color);
+}
+
+/************************* AVX2 *************************/
+
+TARGET_AVX2 static inline __m256i glyph_lanes_avx2(__m256i d, __m256i cov, __m256i col) {
+  __m256i x = _mm256_add_epi16(_mm256_mullo_epi16(col, cov),
+    _mm256_mullo_epi16(d, _mm256_sub_epi16(_mm256_set1_epi16(255), cov)));
+  x = _mm256_add_epi16(x, _mm256_set1_epi16(127));
+  x = _mm256_add_epi16(_mm256_add_epi16(x, _mm256_set1_epi16(1)), _mm256_srli_epi16(x, 8));
+  return _mm256_srli_epi16(x, 8);
+}
+
+/* unpack and pack work within 128 bit halves so the pixel order is kept */
+TARGET_AVX2 static inline void glyph_blend8_avx2(uint32_t *dst, __m256i cov, __m256i col) {
+  const __m256i zero = _mm256_setzero_si256();
+  __m256i d = _mm256_loadu_si256((const __m256i*) dst);
+  __m256i lo = glyph_lanes_avx2(_mm256_unpacklo_epi8(d, zero), _mm256_unpacklo_epi8(cov, zero), col);
+  __m256i hi = glyph_lanes_avx2(_mm256_unpackhi_epi8(d, zero), _mm256_unpackhi_epi8(cov, zero), col);
+  _mm256_storeu_si256((__m256i*) dst, _mm256_packus_epi16(lo, hi));
+}
+
+TARGET_AVX2 static void glyph_gray_avx2(uint32_t *dst, const uint8_t *src, int count, RenColor color) {
+  const __m256i col = _mm256_set_epi16(0, color.r, color.g, color.b, 0, color.r, color.g, color.b,
+    0, color.r, color.g, color.b, 0, color.r, color.g, color.b);
+  const __m256i spread = _mm256_set1_epi32(0x00010101);
+  int x = 0;
+  for (; x + 8 <= count; x += 8) {
+    __m256i cov = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*) (src + x)));
+    glyph_blend8_avx2(dst + x, _mm256_mullo_epi32(cov, spread), col);
+  }
+  glyph_gray_sse2(dst + x, src + x, count - x, color);
+}
+
+TARGET_AVX2 static void glyph_subpixel_avx2(uint32_t *dst, const uint8_t *src, int count, RenColor color) {
+  const __m256i col = _mm256_set_epi16(0, color.r, color.g, color.b, 0, color.r, color.g, color.b,
+    0, color.r, color.g, color.b, 0, color.r, color.g, color.b);
+  int x = 0;
+  for (; x + 8 <= count; x += 8) {
+    const uint8_t *s = src + x * 3;
+    __m256i cov = _mm256_set_epi32(subpixel_coverage(s + 21), subpixel_coverage(s + 18),
+      subpixel_coverage(s + 15), subpixel_coverage(s + 12), subpixel_coverage(s + 9),
+      subpixel_coverage(s + 6), subpixel_coverage(s + 3), subpixel_coverage(s));
+    glyph_blend8_avx2(dst + x, cov, col);
+  }
+  glyph_subpixel_sse2(dst + x, src + x * 3, count - x, color);
+}
+
+TARGET_AVX2 static void rect_avx2(RenColor *dst, int count, RenColor color) {
+  const __m256i zero = _mm256_setzero_si256();
+  const int a = color.a, ia = 0xff - a;
+  const __m256i src = _mm256_set_epi16(0, color.r * a, color.g * a, color.b * a, 0, color.r * a, color.g * a, color.b * a,
+    0, color.r * a, color.g * a, color.b * a, 0, color.r * a, color.g * a, color.b * a);
+  const __m256i weight = _mm256_set_epi16(256, ia, ia, ia, 256, ia, ia, ia, 256, ia, ia, ia, 256, ia, ia, ia);
+  int x = 0;
+  for (; x + 8 <= count; x += 8) {
+    __m256i d = _mm256_loadu_si256((const __m256i*) (dst + x));
+    __m256i lo = _mm256_srli_epi16(_mm256_add_epi16(src, _mm256_mullo_epi16(_mm256_unpacklo_epi8(d, zero), weight)), 8);
+    __m256i hi = _mm256_srli_epi16(_mm256_add_epi16(src, _mm256_mullo_epi16(_mm256_unpackhi_epi8(d, zero), weight)), 8);
+    _mm256_storeu_si256((__m256i*) (dst + x), _mm256_packus_epi16(lo, hi));
+  }
+  rect_sse2(dst + x, count - x, color);
+}
+#endif
+
+#ifdef BLEND_NEON
+/************************* NEON *************************/
+
+static inline uint8x8_t glyph_lanes_neon(uint8x8_t d, uint8x8_t cov, uint8x8_t col) {
+  uint16x8_t x = vmull_u8(col, cov);
+  x = vmlal_u8(x, d, vsub_u8(vdup_n_u8(255), cov));
+  x = vaddq_u16(x, vdupq_n_u16(127));
+  x = vaddq_u16(vaddq_u16(x, vdupq_n_u16(1)), vshrq_n_u16(x, 8));
+  return vshrn_n_u16(x, 8);
+}
+
+static inline void glyph_blend4_neon(uint32_t *dst, uint8x16_t cov, uint8x16_t col) {
+  uint8x16_t d = vld1q_u8((const uint8_t*) dst);
+  uint8x8_t lo = glyph_lanes_neon(vget_low_u8(d), vget_low_u8(cov), vget_low_u8(col));
+  uint8x8_t hi = glyph_lanes_neon(vget_high_u8(d), vget_high_u8(cov), vget_high_u8(col));
+  vst1q_u8((uint8_t*) dst, vcombine_u8(lo, hi));
+}
+
+static inline uint8x16_t color_lanes_neon(RenColor color) {
+  const uint32_t c = color.b | color.g << 8 | (uint32_t) color.r << 16;
+  return vreinterpretq_u8_u32(vdupq_n_u32(c));
+}
+
+static void glyph_gray_neon(uint32_t *dst, const uint8_t *src, int count, RenColor color) {
+  const uint8x16_t col = color_lanes_neon(color);
+  int x = 0;
+  for (; x + 4 <= count; x += 4) {
+    const uint32_t coverage[4] = { src[x] * 0x00010101u, src[x + 1] * 0x00010101u,
+      src[x + 2] * 0x00010101u, src[x + 3] * 0x00010101u };
+    glyph_blend4_neon(dst + x, vreinterpretq_u8_u32(vld1q_u32(coverage)), col);
+  }
+  glyph_gray_scalar(dst + x, src + x, count - x, color);
+}
+
+static void glyph_subpixel_neon(uint32_t *dst, const uint8_t *src, int count, RenColor color) {
+  const uint8x16_t col = color_lanes_neon(color);
+  int x = 0;
+  for (; x + 4 <= count; x += 4) {
+    const uint8_t *s = src + x * 3;
+    const uint32_t coverage[4] = { subpixel_coverage(s), subpixel_coverage(s + 3),
+      subpixel_coverage(s + 6), subpixel_coverage(s + 9) };
+    glyph_blend4_neon(dst + x, vreinterpretq_u8_u32(vld1q_u32(coverage)), col);
+  }
+  glyph_subpixel_scalar(dst + x, src + x * 3, count - x, color);
+}
+
+static void rect_neon(RenColor *dst, int count, RenColor color) {
+  const uint16_t a = color.a, ia = 0xff - a;
+  const uint16_t src_lanes[8] = { color.b * a, color.g * a, color.r * a, 0, color.b * a, color.g * a, color.r * a, 0 };
+  const uint16_t weight_lanes[8] = { ia, ia, ia, 256, ia, ia, ia, 256 };
+  const uint16x8_t src = vld1q_u16(src_lanes), weight = vld1q_u16(weight_lanes);
+  int x = 0;
+  for (; x + 4 <= count; x += 4) {
+    uint8x16_t d = vld1q_u8((const uint8_t*) (dst + x));
+    uint8x8_t lo = vshrn_n_u16(vmlaq_u16(src, vmovl_u8(vget_low_u8(d)), weight), 8);
+    uint8x8_t hi = vshrn_n_u16(vmlaq_u16(src, vmovl_u8(vget_high_u8(d)), weight), 8);
+    vst1q_u8((uint8_t*) (dst + x), vcombine_u8(lo, hi));
+  }
+  rect_scalar(dst + x, count - x, color);
+}
+#endif
+
+RenBlend ren_blend = { glyph_gray_scalar, glyph_subpixel_scalar, rect_scalar, "scalar" };
+
+void ren_blend_init(void) {
+#ifdef BLEND_X86
+  if (SDL_HasAVX2()) {
+    ren_blend = (RenBlend) { glyph_gray_avx2, glyph_subpixel_avx2, rect_avx2, "avx2" };
+  } else if (SDL_HasSSE2()) {
+    ren_blend = (RenBlend) { glyph_gray_sse2, glyph_subpixel_sse2, rect_sse2, "sse2" };
+  }
+#elif defined(BLEND_NEON) && SDL_VERSION_ATLEAST(2, 0, 6)
+  if (SDL_HasNEON()) {
+    ren_blend = (RenBlend) { glyph_gray_neon, glyph_subpixel_neon, rect_neon, "neon" };
+  }
+#endif
+}
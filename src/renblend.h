@@ -0,0 +1,25 @@
+#ifndef RENBLEND_H
+#define RENBLEND_H
+
+#include <stdint.h>
+#include "renderer.h"
+
+/* Pixel blending kernels used by the software renderer. Destination pixels
+   are 32 bit with the color in the low 24 bits (B, G, R in memory order)
+   and the alpha byte left untouched. Every kernel produces exactly the same
+   output as the scalar implementation. */
+typedef struct {
+  /* blend `color` using one 8 bit coverage value per pixel */
+  void (*glyph_gray)(uint32_t *dst, const uint8_t *src, int count, RenColor color);
+  /* blend `color` using R, G, B coverage bytes per pixel */
+  void (*glyph_subpixel)(uint32_t *dst, const uint8_t *src, int count, RenColor color);
+  /* blend the translucent `color` over a row of pixels */
+  void (*rect)(RenColor *dst, int count, RenColor color);
+  const char *name;
+} RenBlend;
+
+extern RenBlend ren_blend;
+
+void ren_blend_init(void);
+
+#endif
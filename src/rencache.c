@@ -1,22 +1,49 @@
+#include <assert.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include <lauxlib.h>
 #include "rencache.h"
+#include "renhash.h"
 
 /* a cache over the software renderer -- all drawing operations are stored as
 ** commands when issued. At the end of the frame we write the commands to a grid
 ** of hash values, take the cells that have changed since the previous frame,
 ** merge them into dirty rectangles and redraw only those regions */
 
-#define CELLS_X 80
-#define CELLS_Y 50
-#define CELL_SIZE 96
-#define COMMAND_BUF_SIZE (1024 * 512)
+/* the grid is sized from the screen: cells are CELL_SIZE_PIXELS wide on the
+** surface so that small changes like a caret blink stay small on HiDPI
+** screens, and grow by powers of two on screens too large for MAX_CELLS */
+#define MAX_CELLS 16384
+#define CELL_SIZE_PIXELS 32
+#define CELL_SIZE_MIN 8
+#define COMMAND_CHUNK_SIZE (1024 * 512)
 #define COMMAND_BARE_SIZE offsetof(Command, text)
+#define MAX_RENDER_THREADS 32
+#define MAX_SCROLL_REGIONS 8
+#define FRAME_STATS_HISTORY 120
+#define FRAME_GRAPH_HEIGHT 100
+#define FRAME_GRAPH_MS_HEIGHT 4
+#define FRAME_GRAPH_EFFICIENCY_HEIGHT 10
+#define MAX_GREEDY_RECTS 64
+#define RECT_COST_CELLS 2
+#define LATENCY_BUCKETS 500
+#define MAX_PENDING_INPUTS 64
 
-enum { SET_CLIP, DRAW_TEXT, DRAW_RECT };
+enum { SET_CLIP, DRAW_TEXT, DRAW_RECT, DRAW_TOKENS };
+
+/* a DRAW_TOKENS command stores the number of spans, the spans and then their
+** texts one after the other, each with its terminating zero */
+typedef struct {
+  RenFont *font;
+  RenColor color;
+  float x;
+  int32_t tab_size;
+  int32_t len;
+} TokenSpan;
 
 typedef struct {
   int8_t type;
@@ -29,33 +56,104 @@ typedef struct {
   char text[0];
 } Command;
 
-static unsigned cells_buf1[CELLS_X * CELLS_Y];
-static unsigned cells_buf2[CELLS_X * CELLS_Y];
-static unsigned *cells_prev = cells_buf1;
-static unsigned *cells = cells_buf2;
-static RenRect rect_buf[CELLS_X * CELLS_Y / 2];
-static char command_buf[COMMAND_BUF_SIZE];
-static int command_buf_idx;
+/* the command stream lives in a chain of chunks that is grown on demand and
+** kept across frames: once the chain is large enough for the biggest frame
+** seen so far no further allocation happens */
+typedef struct CommandChunk {
+  struct CommandChunk *next;
+  size_t capacity, used;
+  char *data;
+} CommandChunk;
+
+static uint64_t cells_buf1[MAX_CELLS];
+static uint64_t cells_buf2[MAX_CELLS];
+static uint64_t *cells_prev = cells_buf1;
+static uint64_t *cells = cells_buf2;
+static RenRect rect_buf[MAX_CELLS];
+static bool dirty_cells[MAX_CELLS];
+static int span_rects[2][MAX_CELLS];
+static CommandChunk *command_head;
+static CommandChunk *command_tail;
+static size_t command_buf_used;
+static size_t command_buf_last_frame;
+static size_t command_buf_capacity;
+static size_t command_buf_high_water;
 static RenRect screen_rect;
+static int screen_scale;
+static int cells_x = 1, cells_y = 1, cell_size = CELL_SIZE_PIXELS;
 static bool show_debug;
 
-static inline int min(int a, int b) { return a < b ? a : b; }
-static inline int max(int a, int b) { return a > b ? a : b; }
+/* regions whose content moved vertically since the last frame. The cells
+** lying fully inside a region are compared with the cells of the last frame
+** they were shifted from, and those found unchanged are blitted into place
+** rather than redrawn */
+enum { SCROLL_NONE, SCROLL_CLEAN, SCROLL_DIRTY };
+
+typedef struct {
+  RenRect rect;
+  int dy;
+} ScrollRegion;
 
+static ScrollRegion scroll_regions[MAX_SCROLL_REGIONS];
+static int scroll_region_count;
+static RenRect scroll_blits[MAX_SCROLL_REGIONS];
+static int scroll_blit_count;
+static uint64_t cells_scrolled[MAX_CELLS];
+static uint8_t scroll_state[MAX_CELLS];
 
-/* 32bit fnv-1a hash */
-#define HASH_INITIAL 2166136261
+/* timings and counters of the last frames, oldest first from the index */
+static RenFrameStats frame_stats[FRAME_STATS_HISTORY];
+static int frame_stats_index;
+static RenFrameStats frame_current;
+static Uint64 frame_draw_start;
+static size_t frame_glyph_loads;
 
-static void hash(unsigned *h, const void *data, int size) {
-  const unsigned char *p = data;
-  while (size--) {
-    *h = (*h ^ *p++) * 16777619;
-  }
-}
+/* keypress to present latency: timestamps of the key events polled since the
+** last present, and a histogram of 1ms buckets, the last one for anything
+** slower */
+static Uint32 pending_inputs[MAX_PENDING_INPUTS];
+static int pending_input_count;
+static unsigned latency_buckets[LATENCY_BUCKETS];
+static unsigned latency_count;
+static Uint32 latency_max;
+static double latency_sum;
+
+/* spatial bins: every cell keeps the list of commands touching it so that a
+** dirty rect only replays the commands overlapping its cells. Commands are
+** numbered in stream order and each rendering thread collects the numbers
+** for its rect into a bitmask, which gives them back in the original order */
+typedef struct {
+  int command;
+  int next;
+} BinEntry;
+
+static int cell_bin_head[MAX_CELLS];
+static int cell_bin_tail[MAX_CELLS];
+static int cell_bin_count[MAX_CELLS];
+static BinEntry *bin_entries;
+static int bin_entries_count, bin_entries_capacity;
+static Command **binned_commands;
+static int binned_commands_count, binned_commands_capacity;
+static uint64_t *replay_masks;
+static int replay_masks_words;
+static bool bins_valid;
+
+/* worker pool used to redraw the dirty rects in parallel, the main thread
+** takes part in the drawing so n threads means n - 1 workers */
+static int render_thread_count = 1;
+static SDL_Thread *render_threads[MAX_RENDER_THREADS];
+static SDL_sem *render_work_sem;
+static SDL_sem *render_done_sem;
+static SDL_atomic_t render_next_rect;
+static int render_rect_count;
+static bool render_threads_quit;
+
+static inline int min(int a, int b) { return a < b ? a : b; }
+static inline int max(int a, int b) { return a > b ? a : b; }
 
 
 static inline int cell_idx(int x, int y) {
-  return x + y * CELLS_X;
+  return x + y * cells_x;
 }
 
 
@@ -74,6 +172,12 @@ static RenRect intersect_rects(RenRect a, RenRect b) {
 }
 
 
+static inline bool rects_intersect(RenRect a, RenRect b) {
+  return b.x + b.width  > a.x && b.x < a.x + a.width
+      && b.y + b.height > a.y && b.y < a.y + a.height;
+}
+
+
 static RenRect merge_rects(RenRect a, RenRect b) {
   int x1 = min(a.x, b.x);
   int y1 = min(a.y, b.y);
@@ -83,36 +187,191 @@ static RenRect merge_rects(RenRect a, RenRect b) {
 }
 
 
+static CommandChunk* new_command_chunk(size_t capacity) {
+  CommandChunk *chunk = malloc(sizeof(CommandChunk) + capacity);
+  if (!chunk) { return NULL; }
+  chunk->next = NULL;
+  chunk->capacity = capacity;
+  chunk->used = 0;
+  chunk->data = (char*) (chunk + 1);
+  command_buf_capacity += capacity;
+  return chunk;
+}
+
+
 static Command* push_command(int type, int size) {
-  Command *cmd = (Command*) (command_buf + command_buf_idx);
-  int n = command_buf_idx + size;
-  if (n > COMMAND_BUF_SIZE) {
-    fprintf(stderr, "Warning: (" __FILE__ "): exhausted command buffer\n");
-    return NULL;
+  if (!command_tail) {
+    command_head = command_tail = new_command_chunk(COMMAND_CHUNK_SIZE);
+    if (!command_tail) { goto exhausted; }
+  }
+  if (command_tail->used + size > command_tail->capacity) {
+    /* reuse the next chunk from a previous frame if the command fits in it,
+    ** otherwise insert a fresh one large enough to hold it */
+    CommandChunk *next = command_tail->next;
+    if (!next || next->capacity < size) {
+      next = new_command_chunk(size > COMMAND_CHUNK_SIZE ? size : COMMAND_CHUNK_SIZE);
+      if (!next) { goto exhausted; }
+      next->next = command_tail->next;
+      command_tail->next = next;
+    }
+    command_tail = next;
   }
-  command_buf_idx = n;
+  Command *cmd = (Command*) (command_tail->data + command_tail->used);
+  command_tail->used += size;
+  command_buf_used += size;
   memset(cmd, 0, COMMAND_BARE_SIZE);
   cmd->type = type;
   cmd->size = size;
   return cmd;
+exhausted:
+  fprintf(stderr, "Warning: (" __FILE__ "): unable to grow command buffer\n");
+  return NULL;
 }
 
 
-static bool next_command(Command **prev) {
+static bool next_command(CommandChunk **chunk, Command **prev) {
+  char *p;
   if (*prev == NULL) {
-    *prev = (Command*) command_buf;
+    *chunk = command_head;
+    p = *chunk ? (*chunk)->data : NULL;
   } else {
-    *prev = (Command*) (((char*) *prev) + (*prev)->size);
+    p = ((char*) *prev) + (*prev)->size;
+  }
+  /* skip to the next chunk holding commands; chunks past the tail are
+  ** leftovers from larger frames and are empty */
+  while (*chunk && p == (*chunk)->data + (*chunk)->used) {
+    if (*chunk == command_tail) { return false; }
+    *chunk = (*chunk)->next;
+    p = (*chunk)->data;
+  }
+  *prev = (Command*) p;
+  return *chunk != NULL;
+}
+
+
+static void reset_commands(void) {
+  for (CommandChunk *chunk = command_head; chunk; chunk = chunk->next) {
+    chunk->used = 0;
+  }
+  command_tail = command_head;
+  if (command_buf_used > command_buf_high_water) {
+    command_buf_high_water = command_buf_used;
   }
-  return *prev != ((Command*) (command_buf + command_buf_idx));
+  command_buf_last_frame = command_buf_used;
+  command_buf_used = 0;
+}
+
+
+void rencache_get_command_buffer_stats(size_t *last_frame, size_t *capacity, size_t *high_water) {
+  *last_frame = command_buf_last_frame;
+  *capacity = command_buf_capacity;
+  *high_water = command_buf_high_water;
+}
+
+
+void rencache_each_command(void (*fn)(const void *data, size_t size, void *udata), void *udata) {
+  CommandChunk *chunk = NULL;
+  Command *cmd = NULL;
+  while (next_command(&chunk, &cmd)) { fn(cmd, cmd->size, udata); }
 }
 
 
 void rencache_show_debug(bool enable) {
+  /* redraw what the frame graph was covering */
+  if (show_debug && !enable) { rencache_invalidate(); }
   show_debug = enable;
 }
 
 
+void rencache_scroll_region(RenRect rect, int dy) {
+  if (dy == 0) { return; }
+  for (int i = 0; i < scroll_region_count; i++) {
+    RenRect *r = &scroll_regions[i].rect;
+    if (r->x == rect.x && r->y == rect.y && r->width == rect.width && r->height == rect.height) {
+      scroll_regions[i].dy += dy;
+      return;
+    }
+  }
+  /* without a hint the region is simply redrawn */
+  if (scroll_region_count == MAX_SCROLL_REGIONS) { return; }
+  scroll_regions[scroll_region_count++] = (ScrollRegion) { rect, dy };
+}
+
+
+void rencache_set_frame_times(double events, double update) {
+  frame_current.events = events;
+  frame_current.update = update;
+}
+
+
+void rencache_get_frame_stats(RenFrameStats *stats) {
+  *stats = frame_stats[(frame_stats_index + FRAME_STATS_HISTORY - 1) % FRAME_STATS_HISTORY];
+}
+
+
+void rencache_input_event(Uint32 timestamp) {
+  if (pending_input_count < MAX_PENDING_INPUTS) {
+    pending_inputs[pending_input_count++] = timestamp;
+  }
+}
+
+
+static void record_input_latency(void) {
+  Uint32 now = SDL_GetTicks();
+  for (int i = 0; i < pending_input_count; i++) {
+    Uint32 ms = now - pending_inputs[i];
+    latency_buckets[ms < LATENCY_BUCKETS ? ms : LATENCY_BUCKETS - 1]++;
+    latency_max = ms > latency_max ? ms : latency_max;
+    latency_sum += ms;
+    latency_count++;
+  }
+  pending_input_count = 0;
+}
+
+
+static double latency_percentile(double p) {
+  unsigned rank = (unsigned) (p * (latency_count - 1)), seen = 0;
+  for (int i = 0; i < LATENCY_BUCKETS; i++) {
+    seen += latency_buckets[i];
+    if (seen > rank) { return i / 1000.0; }
+  }
+  return latency_max / 1000.0;
+}
+
+
+void rencache_get_input_latency(RenLatencyStats *stats) {
+  stats->count = latency_count;
+  if (latency_count == 0) {
+    stats->p50 = stats->p99 = stats->max = stats->mean = 0;
+    return;
+  }
+  stats->p50 = latency_percentile(0.5);
+  stats->p99 = latency_percentile(0.99);
+  stats->max = latency_max / 1000.0;
+  stats->mean = latency_sum / latency_count / 1000.0;
+}
+
+
+void rencache_reset_input_latency(void) {
+  memset(latency_buckets, 0, sizeof(latency_buckets));
+  latency_count = 0;
+  latency_max = 0;
+  latency_sum = 0;
+}
+
+
+static double seconds_since(Uint64 start) {
+  return (double) (SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
+}
+
+
+static size_t glyph_loads(void) {
+  RenGlyphStats stats;
+  ren_get_glyph_stats(&stats);
+  return stats.measured + stats.rasterized;
+}
+
+
 void rencache_set_clip_rect(RenRect rect) {
   Command *cmd = push_command(SET_CLIP, COMMAND_BARE_SIZE);
   if (cmd) { cmd->rect = intersect_rects(rect, screen_rect); }
@@ -148,127 +407,715 @@ float rencache_draw_text(lua_State *L, RenFont *font, const char *text, float x,
 }
 
 
+float rencache_draw_tokens(lua_State *L, const RenTextSpan *spans, int count, float x, int y)
+{
+  size_t size = COMMAND_BARE_SIZE + sizeof(int32_t) + count * sizeof(TokenSpan);
+  for (int i = 0; i < count; i++) {
+    size += spans[i].len + 1;
+  }
+  Command *cmd = size <= INT32_MAX ? push_command(DRAW_TOKENS, size) : NULL;
+  char *p = cmd ? cmd->text + sizeof(int32_t) + count * sizeof(TokenSpan) : NULL;
+  int32_t n = count;
+  if (cmd) { memcpy(cmd->text, &n, sizeof(n)); }
+
+  float start_x = x;
+  int height = 0;
+  for (int i = 0; i < count; i++) {
+    const RenTextSpan *span = &spans[i];
+    if (cmd) {
+      TokenSpan stored = { span->font, span->color, x, ren_font_get_tab_size(span->font), span->len };
+      memcpy(cmd->text + sizeof(int32_t) + i * sizeof(TokenSpan), &stored, sizeof(stored));
+      memcpy(p, span->text, span->len + 1);
+      p += span->len + 1;
+    }
+    x += ren_font_get_width(span->font, span->text);
+    height = max(height, ren_font_get_height(span->font));
+  }
+  if (!cmd) { return x; }
+
+  cmd->rect = (RenRect) { start_x, y, (int) (x - start_x), height };
+  cmd->text_x = start_x;
+  if (!rects_overlap(screen_rect, cmd->rect)) {
+    /* drop the line, it is the last command of the tail chunk */
+    command_tail->used -= cmd->size;
+    command_buf_used -= cmd->size;
+  }
+  return x;
+}
+
+
 void rencache_invalidate(void) {
   memset(cells_prev, 0xff, sizeof(cells_buf1));
 }
 
 
+static void resize_grid(int w, int h) {
+  cell_size = max(CELL_SIZE_PIXELS / screen_scale, CELL_SIZE_MIN);
+  while ((w / cell_size + 1) * (h / cell_size + 1) > MAX_CELLS) {
+    cell_size *= 2;
+  }
+  cells_x = w / cell_size + 1;
+  cells_y = h / cell_size + 1;
+  for (int i = 0; i < MAX_CELLS; i++) {
+    cells[i] = HASH_INITIAL;
+  }
+  memset(scroll_state, SCROLL_NONE, sizeof(scroll_state));
+  scroll_region_count = 0;
+}
+
+
 void rencache_begin_frame(lua_State *L) {
-  /* reset all cells if the screen width/height has changed */
-  int w, h;
+  /* rebuild the grid and reset all cells if the screen size or scale has
+  ** changed */
+  int w, h, scale = ren_get_scale();
   ren_get_size(&w, &h);
-  if (screen_rect.width != w || h != screen_rect.height) {
+  if (screen_rect.width != w || h != screen_rect.height || scale != screen_scale) {
     screen_rect.width = w;
     screen_rect.height = h;
+    screen_scale = scale;
+    resize_grid(w, h);
     rencache_invalidate();
   }
+  ren_begin_frame();
+  frame_draw_start = SDL_GetPerformanceCounter();
+  frame_glyph_loads = glyph_loads();
+}
+
+
+/* the pixels a command can touch: glyphs can overhang the measured text width
+** (italics, negative side bearings), so text gets some horizontal slack */
+static RenRect command_bounds(Command *cmd, RenRect clip) {
+  RenRect r = cmd->rect;
+  if (cmd->type == DRAW_TEXT || cmd->type == DRAW_TOKENS) {
+    r.x -= r.height;
+    r.width += r.height * 2;
+    clip = intersect_rects(clip, screen_rect);
+  }
+  return intersect_rects(r, clip);
+}
+
+
+static void update_overlapping_cells(RenRect r, uint64_t h) {
+  int x1 = max(0, r.x / cell_size);
+  int y1 = max(0, r.y / cell_size);
+  int x2 = min(cells_x - 1, (r.x + r.width) / cell_size);
+  int y2 = min(cells_y - 1, (r.y + r.height) / cell_size);
+
+  for (int y = y1; y <= y2; y++) {
+    for (int x = x1; x <= x2; x++) {
+      int idx = cell_idx(x, y);
+      cells[idx] = hash_mix(cells[idx] ^ h, HASH_PRIME);
+    }
+  }
+}
+
+
+/* hashes the frame into cells_scrolled over the cells of `inner` as if it was
+** shifted back by dy, that is in the coordinates of the last frame. Clip
+** rects are not shifted as they stay in place when the content scrolls; a
+** clip edge crossing the region would make a shifted pixel fall on the other
+** side of it, in which case the region can't be reused */
+static bool hash_scrolled_cells(RenRect inner, int dy) {
+  RenRect area = { inner.x * cell_size, inner.y * cell_size, inner.width * cell_size, inner.height * cell_size };
+  for (int y = inner.y; y < inner.y + inner.height; y++) {
+    for (int x = inner.x; x < inner.x + inner.width; x++) {
+      cells_scrolled[cell_idx(x, y)] = HASH_INITIAL;
+    }
+  }
+  CommandChunk *chunk = NULL;
+  Command *cmd = NULL;
+  RenRect cr = screen_rect;
+  while (next_command(&chunk, &cmd)) {
+    RenRect r;
+    if (cmd->type == SET_CLIP) {
+      cr = cmd->rect;
+      bool crosses = (cr.y > area.y && cr.y < area.y + area.height) ||
+        (cr.y + cr.height > area.y && cr.y + cr.height < area.y + area.height);
+      if (crosses && cr.x < area.x + area.width && cr.x + cr.width > area.x) { return false; }
+      r = cr;
+    } else {
+      r = command_bounds(cmd, cr);
+      r.y -= dy;
+    }
+    if (r.width == 0 || r.height == 0 || !rects_overlap(r, area)) { continue; }
+    uint64_t h = HASH_INITIAL;
+    if (cmd->type == SET_CLIP) {
+      hash(&h, cmd, cmd->size);
+    } else {
+      cmd->rect.y -= dy;
+      hash(&h, cmd, cmd->size);
+      cmd->rect.y += dy;
+    }
+    /* same cell coverage as update_overlapping_cells */
+    int x1 = max(r.x / cell_size, inner.x), x2 = min((r.x + r.width) / cell_size, inner.x + inner.width - 1);
+    int y1 = max(r.y / cell_size, inner.y), y2 = min((r.y + r.height) / cell_size, inner.y + inner.height - 1);
+    for (int y = y1; y <= y2; y++) {
+      for (int x = x1; x <= x2; x++) {
+        int idx = cell_idx(x, y);
+        cells_scrolled[idx] = hash_mix(cells_scrolled[idx] ^ h, HASH_PRIME);
+      }
+    }
+  }
+  return true;
+}
+
+
+static void apply_scroll_regions(void) {
+  scroll_blit_count = 0;
+  for (int i = 0; i < scroll_region_count; i++) {
+    RenRect rect = scroll_regions[i].rect;
+    int dy = scroll_regions[i].dy;
+    /* only cells fully inside the region and the screen can be reused */
+    int x1 = (max(rect.x, 0) + cell_size - 1) / cell_size;
+    int y1 = (max(rect.y, 0) + cell_size - 1) / cell_size;
+    int x2 = min(rect.x + rect.width, screen_rect.width) / cell_size;
+    int y2 = min(rect.y + rect.height, screen_rect.height) / cell_size;
+    if (x2 <= x1 || y2 <= y1 || abs(dy) >= (y2 - y1) * cell_size) { continue; }
+    RenRect inner = { x1, y1, x2 - x1, y2 - y1 };
+    bool overlaps = false;
+    for (int j = 0; j < scroll_blit_count; j++) {
+      RenRect b = scroll_blits[j];
+      overlaps |= rects_intersect(inner, (RenRect) { b.x / cell_size, b.y / cell_size, b.width / cell_size, b.height / cell_size });
+    }
+    if (overlaps || !hash_scrolled_cells(inner, dy)) { continue; }
+
+    /* a cell is clean if the cells it was shifted from are unchanged */
+    int clean = 0;
+    for (int y = y1; y < y2; y++) {
+      int top = y * cell_size - dy, bottom = top + cell_size - 1;
+      bool exposed = top < y1 * cell_size || bottom >= y2 * cell_size;
+      for (int x = x1; x < x2; x++) {
+        int idx = cell_idx(x, y);
+        bool changed = exposed;
+        if (!changed) {
+          int from1 = cell_idx(x, top / cell_size), from2 = cell_idx(x, bottom / cell_size);
+          changed = cells_scrolled[from1] != cells_prev[from1] || cells_scrolled[from2] != cells_prev[from2];
+        }
+        scroll_state[idx] = changed ? SCROLL_DIRTY : SCROLL_CLEAN;
+        clean += !changed;
+      }
+    }
+    if (clean == 0) {
+      for (int y = y1; y < y2; y++) {
+        for (int x = x1; x < x2; x++) { scroll_state[cell_idx(x, y)] = SCROLL_NONE; }
+      }
+      continue;
+    }
+    RenRect blit = { x1 * cell_size, y1 * cell_size, (x2 - x1) * cell_size, (y2 - y1) * cell_size };
+    ren_scroll_rect(blit, dy);
+    scroll_blits[scroll_blit_count++] = blit;
+  }
+  scroll_region_count = 0;
+}
+
+
+static bool grow_array(void **array, int *capacity, int needed, size_t item_size) {
+  if (needed <= *capacity) { return true; }
+  int new_capacity = *capacity > 0 ? *capacity : 1024;
+  while (new_capacity < needed) { new_capacity *= 2; }
+  void *new_array = realloc(*array, new_capacity * item_size);
+  if (!new_array) { return false; }
+  *array = new_array;
+  *capacity = new_capacity;
+  return true;
+}
+
+
+static void reset_bins(void) {
+  memset(cell_bin_head, 0xff, cells_x * cells_y * sizeof(int));
+  memset(cell_bin_count, 0, cells_x * cells_y * sizeof(int));
+  bin_entries_count = 0;
+  binned_commands_count = 0;
+  bins_valid = true;
 }
 
 
-static void update_overlapping_cells(RenRect r, unsigned h) {
-  int x1 = r.x / CELL_SIZE;
-  int y1 = r.y / CELL_SIZE;
-  int x2 = (r.x + r.width) / CELL_SIZE;
-  int y2 = (r.y + r.height) / CELL_SIZE;
+static void bin_command(Command *cmd, RenRect r) {
+  if (!bins_valid) { return; }
+  int x1 = max(0, r.x / cell_size);
+  int y1 = max(0, r.y / cell_size);
+  int x2 = min(cells_x - 1, (r.x + r.width) / cell_size);
+  int y2 = min(cells_y - 1, (r.y + r.height) / cell_size);
+  int cells_touched = max(0, x2 - x1 + 1) * max(0, y2 - y1 + 1);
+
+  if (!grow_array((void**) &binned_commands, &binned_commands_capacity, binned_commands_count + 1, sizeof(Command*))
+   || !grow_array((void**) &bin_entries, &bin_entries_capacity, bin_entries_count + cells_touched, sizeof(BinEntry))) {
+    bins_valid = false;
+    return;
+  }
+  int index = binned_commands_count++;
+  binned_commands[index] = cmd;
 
   for (int y = y1; y <= y2; y++) {
     for (int x = x1; x <= x2; x++) {
       int idx = cell_idx(x, y);
-      hash(&cells[idx], &h, sizeof(h));
+      int entry = bin_entries_count++;
+      bin_entries[entry] = (BinEntry) { index, -1 };
+      if (cell_bin_head[idx] < 0) {
+        cell_bin_head[idx] = entry;
+      } else {
+        bin_entries[cell_bin_tail[idx]].next = entry;
+      }
+      cell_bin_tail[idx] = entry;
+      cell_bin_count[idx]++;
+    }
+  }
+}
+
+
+static inline int rect_area(RenRect r) {
+  return r.width * r.height;
+}
+
+
+/* turns the dirty cells into rects in three passes: runs of dirty cells in a
+** row become spans, a span continuing one of the exact same columns in the
+** row above extends it downwards, and the rects left are merged greedily,
+** cheapest pair first, for as long as the area wasted by a merge is smaller
+** than the fixed cost of replaying and presenting one more rect. The greedy
+** pass is quadratic and only runs when the spans stacked into few rects */
+static int coalesce_dirty_cells(int max_x, int max_y) {
+  int count = 0;
+  int *above = span_rects[0], above_count = 0;
+  int *row = span_rects[1], row_count = 0;
+  for (int y = 0; y < max_y; y++) {
+    row_count = 0;
+    for (int x = 0; x < max_x; x++) {
+      if (!dirty_cells[cell_idx(x, y)]) { continue; }
+      int x1 = x;
+      while (x < max_x && dirty_cells[cell_idx(x, y)]) {
+        dirty_cells[cell_idx(x, y)] = false;
+        x++;
+      }
+      int i = 0;
+      while (i < above_count && (rect_buf[above[i]].x != x1 || rect_buf[above[i]].width != x - x1)) { i++; }
+      if (i < above_count) {
+        rect_buf[above[i]].height++;
+        row[row_count++] = above[i];
+      } else {
+        rect_buf[count] = (RenRect) { x1, y, x - x1, 1 };
+        row[row_count++] = count++;
+      }
+    }
+    int *tmp = above;
+    above = row;
+    row = tmp;
+    above_count = row_count;
+  }
+
+  while (count > 1 && count <= MAX_GREEDY_RECTS) {
+    int best_i = -1, best_j = -1, best_waste = RECT_COST_CELLS;
+    for (int i = 0; i < count; i++) {
+      for (int j = i + 1; j < count; j++) {
+        int waste = rect_area(merge_rects(rect_buf[i], rect_buf[j])) - rect_area(rect_buf[i]) - rect_area(rect_buf[j]);
+        if (waste < best_waste) {
+          best_waste = waste;
+          best_i = i;
+          best_j = j;
+        }
+      }
+    }
+    if (best_i < 0) { break; }
+    RenRect merged = merge_rects(rect_buf[best_i], rect_buf[best_j]);
+    rect_buf[best_i] = merged;
+    rect_buf[best_j] = rect_buf[--count];
+    /* rects swallowed by the merge are dropped */
+    for (int k = 0; k < count; k++) {
+      RenRect r = rect_buf[k];
+      if (k != best_i && r.x >= merged.x && r.y >= merged.y
+       && r.x + r.width <= merged.x + merged.width && r.y + r.height <= merged.y + merged.height) {
+        if (best_i == count - 1) { best_i = k; }
+        rect_buf[k--] = rect_buf[--count];
+      }
+    }
+  }
+  return count;
+}
+
+
+static int merge_intersecting_rects(int count) {
+  /* a greedy merge in coalesce_dirty_cells can grow a rect over part of
+  ** another one; merge until no two rects share a pixel. A merged rect can
+  ** reach rects already checked, so every merge starts the scan over */
+  for (int i = 0; i < count; i++) {
+    for (int j = i + 1; j < count; j++) {
+      if (rects_intersect(rect_buf[i], rect_buf[j])) {
+        rect_buf[i] = merge_rects(rect_buf[i], rect_buf[j]);
+        rect_buf[j] = rect_buf[--count];
+        i = -1;
+        break;
+      }
+    }
+  }
+#ifndef NDEBUG
+  for (int i = 0; i < count; i++) {
+    for (int j = i + 1; j < count; j++) {
+      assert(!rects_intersect(rect_buf[i], rect_buf[j]));
+    }
+  }
+#endif
+  return count;
+}
+
+
+static bool prepare_fonts_for_threads(void) {
+  /* settle the tab size of every font drawn in this frame so that worker
+  ** threads only read font state. A font drawn with different tab sizes
+  ** in the same frame has to be drawn by the main thread alone */
+  CommandChunk *chunk = NULL;
+  Command *cmd = NULL;
+  for (int pass = 0; pass < 2; pass++) {
+    cmd = NULL;
+    while (next_command(&chunk, &cmd)) {
+      if (cmd->type == DRAW_TEXT && ren_font_get_tab_size(cmd->font) != cmd->tab_size) {
+        if (pass > 0) { return false; }
+        ren_font_set_tab_size(cmd->font, cmd->tab_size);
+      } else if (cmd->type == DRAW_TOKENS) {
+        int32_t count;
+        memcpy(&count, cmd->text, sizeof(count));
+        for (int i = 0; i < count; i++) {
+          TokenSpan span;
+          memcpy(&span, cmd->text + sizeof(int32_t) + i * sizeof(TokenSpan), sizeof(span));
+          if (ren_font_get_tab_size(span.font) != span.tab_size) {
+            if (pass > 0) { return false; }
+            ren_font_set_tab_size(span.font, span.tab_size);
+          }
+        }
+      }
+    }
+  }
+  return true;
+}
+
+
+static void draw_command(Command *cmd, RenRect r) {
+  switch (cmd->type) {
+    case SET_CLIP:
+      ren_set_clip_rect(intersect_rects(cmd->rect, r));
+      break;
+    case DRAW_RECT:
+      ren_draw_rect(cmd->rect, cmd->color);
+      break;
+    case DRAW_TEXT:
+      if (ren_font_get_tab_size(cmd->font) != cmd->tab_size) {
+        ren_font_set_tab_size(cmd->font, cmd->tab_size);
+      }
+      ren_draw_text(cmd->font, cmd->text, cmd->text_x, cmd->rect.y, cmd->color);
+      break;
+    case DRAW_TOKENS: {
+      int32_t count;
+      memcpy(&count, cmd->text, sizeof(count));
+      const char *text = cmd->text + sizeof(int32_t) + count * sizeof(TokenSpan);
+      for (int i = 0; i < count; i++) {
+        TokenSpan span;
+        memcpy(&span, cmd->text + sizeof(int32_t) + i * sizeof(TokenSpan), sizeof(span));
+        if (ren_font_get_tab_size(span.font) != span.tab_size) {
+          ren_font_set_tab_size(span.font, span.tab_size);
+        }
+        ren_draw_text(span.font, text, span.x, cmd->rect.y, span.color);
+        text += span.len + 1;
+      }
+      break;
+    }
+  }
+}
+
+
+static void draw_region(RenRect r, int thread) {
+  /* the rect is still in cell units here, see rencache_end_frame */
+  RenRect cr = r;
+  r = intersect_rects((RenRect) { r.x * cell_size, r.y * cell_size, r.width * cell_size, r.height * cell_size }, screen_rect);
+  ren_set_clip_rect(r);
+
+  int cx2 = min(cr.x + cr.width, cells_x), cy2 = min(cr.y + cr.height, cells_y);
+  int entries = 0;
+  if (bins_valid) {
+    for (int y = cr.y; y < cy2; y++) {
+      for (int x = cr.x; x < cx2; x++) {
+        entries += cell_bin_count[cell_idx(x, y)];
+      }
+    }
+  }
+
+  if (!bins_valid || entries >= binned_commands_count) {
+    /* the rect covers most of the commands: walk the whole stream */
+    CommandChunk *chunk = NULL;
+    Command *cmd = NULL;
+    while (next_command(&chunk, &cmd)) {
+      draw_command(cmd, r);
+    }
+    return;
+  }
+
+  uint64_t *mask = replay_masks + thread * replay_masks_words;
+  int words = (binned_commands_count + 63) / 64;
+  for (int y = cr.y; y < cy2; y++) {
+    for (int x = cr.x; x < cx2; x++) {
+      for (int e = cell_bin_head[cell_idx(x, y)]; e >= 0; e = bin_entries[e].next) {
+        int index = bin_entries[e].command;
+        mask[index / 64] |= (uint64_t) 1 << (index % 64);
+      }
+    }
+  }
+  for (int w = 0; w < words; w++) {
+    uint64_t bits = mask[w];
+    mask[w] = 0;
+    while (bits) {
+      int bit = __builtin_ctzll(bits);
+      bits &= bits - 1;
+      draw_command(binned_commands[w * 64 + bit], r);
     }
   }
 }
 
 
-static void push_rect(RenRect r, int *count) {
-  /* try to merge with existing rectangle */
-  for (int i = *count - 1; i >= 0; i--) {
-    RenRect *rp = &rect_buf[i];
-    if (rects_overlap(*rp, r)) {
-      *rp = merge_rects(*rp, r);
+static void draw_pending_regions(int thread) {
+  int i;
+  while ((i = SDL_AtomicAdd(&render_next_rect, 1)) < render_rect_count) {
+    draw_region(rect_buf[i], thread);
+  }
+}
+
+
+static int render_worker(void *data) {
+  int thread = (intptr_t) data;
+  while (true) {
+    SDL_SemWait(render_work_sem);
+    if (render_threads_quit) { break; }
+    draw_pending_regions(thread);
+    SDL_SemPost(render_done_sem);
+  }
+  ren_free_thread_caches();
+  return 0;
+}
+
+
+static void stop_render_threads(void) {
+  render_threads_quit = true;
+  for (int i = 1; i < render_thread_count; i++) {
+    SDL_SemPost(render_work_sem);
+  }
+  for (int i = 1; i < render_thread_count; i++) {
+    SDL_WaitThread(render_threads[i], NULL);
+    render_threads[i] = NULL;
+  }
+  render_threads_quit = false;
+  render_thread_count = 1;
+}
+
+
+void rencache_set_render_threads(int n) {
+  n = max(1, min(n, MAX_RENDER_THREADS));
+  if (n == render_thread_count) { return; }
+  stop_render_threads();
+  if (!render_work_sem) {
+    render_work_sem = SDL_CreateSemaphore(0);
+    render_done_sem = SDL_CreateSemaphore(0);
+    if (!render_work_sem || !render_done_sem) {
+      fprintf(stderr, "Warning: (" __FILE__ "): unable to create render semaphores: %s\n", SDL_GetError());
       return;
     }
   }
-  /* couldn't merge with previous rectangle: push */
-  rect_buf[(*count)++] = r;
+  for (int i = 1; i < n; i++) {
+    render_threads[i] = SDL_CreateThread(render_worker, "render", (void*) (intptr_t) i);
+    if (!render_threads[i]) {
+      fprintf(stderr, "Warning: (" __FILE__ "): unable to create render thread: %s\n", SDL_GetError());
+      break;
+    }
+    render_thread_count = i + 1;
+  }
+}
+
+
+static RenRect frame_graph_rect(void) {
+  int width = FRAME_STATS_HISTORY * 2;
+  int height = FRAME_GRAPH_HEIGHT + FRAME_GRAPH_EFFICIENCY_HEIGHT;
+  return (RenRect) { screen_rect.width - width - 10, screen_rect.height - height - 10, width, height };
+}
+
+
+static void draw_frame_graph(void) {
+  /* one column per frame, stacked from the bottom in stage order, under a
+  ** strip showing the share of the redrawn area that had changed */
+  static const RenColor stage_colors[] = {
+    { .r = 90,  .g = 90,  .b = 220, .a = 255 }, /* events */
+    { .r = 80,  .g = 200, .b = 220, .a = 255 }, /* update */
+    { .r = 80,  .g = 200, .b = 80,  .a = 255 }, /* draw */
+    { .r = 230, .g = 210, .b = 60,  .a = 255 }, /* hash */
+    { .r = 230, .g = 120, .b = 40,  .a = 255 }, /* replay */
+    { .r = 220, .g = 60,  .b = 60,  .a = 255 }, /* present */
+  };
+  RenRect g = frame_graph_rect();
+  ren_set_clip_rect(g);
+  ren_draw_rect(g, (RenColor) { .a = 200 });
+  for (int i = 0; i < FRAME_STATS_HISTORY; i++) {
+    RenFrameStats *f = &frame_stats[(frame_stats_index + i) % FRAME_STATS_HISTORY];
+    double stages[] = { f->events, f->update, f->draw, f->hash, f->replay, f->present };
+    int y = g.y + g.height;
+    for (int s = 0; s < 6 && y > g.y + FRAME_GRAPH_EFFICIENCY_HEIGHT; s++) {
+      int h = min(stages[s] * 1000 * FRAME_GRAPH_MS_HEIGHT + 0.5, y - g.y - FRAME_GRAPH_EFFICIENCY_HEIGHT);
+      ren_draw_rect((RenRect) { g.x + i * 2, y - h, 2, h }, stage_colors[s]);
+      y -= h;
+    }
+    if (f->redrawn_cells > 0) {
+      int h = (FRAME_GRAPH_EFFICIENCY_HEIGHT - 2) * f->changed_cells / f->redrawn_cells;
+      ren_draw_rect((RenRect) { g.x + i * 2, g.y + FRAME_GRAPH_EFFICIENCY_HEIGHT - 2 - h, 2, h }, (RenColor) { 200, 200, 200, 255 });
+    }
+  }
+  /* budget of a 60 fps frame */
+  int budget_y = g.y + g.height - 1000 * FRAME_GRAPH_MS_HEIGHT / 60;
+  ren_draw_rect((RenRect) { g.x, budget_y, g.width, 1 }, (RenColor) { 255, 255, 255, 120 });
 }
 
 
 void rencache_end_frame(lua_State *L) {
+  RenFrameStats *stats = &frame_current;
+  stats->draw = seconds_since(frame_draw_start);
+  Uint64 stage_start = SDL_GetPerformanceCounter();
+
   /* update cells from commands */
+  CommandChunk *chunk = NULL;
   Command *cmd = NULL;
   RenRect cr = screen_rect;
-  while (next_command(&cmd)) {
+  reset_bins();
+  stats->commands = 0;
+  while (next_command(&chunk, &cmd)) {
+    stats->commands++;
     if (cmd->type == SET_CLIP) { cr = cmd->rect; }
-    RenRect r = intersect_rects(cmd->rect, cr);
+    RenRect r = command_bounds(cmd, cr);
     if (r.width == 0 || r.height == 0) { continue; }
-    unsigned h = HASH_INITIAL;
+    uint64_t h = HASH_INITIAL;
     hash(&h, cmd, cmd->size);
     update_overlapping_cells(r, h);
+    bin_command(cmd, r);
   }
 
-  /* push rects for all cells changed from last frame, reset cells */
-  int rect_count = 0;
-  int max_x = screen_rect.width / CELL_SIZE + 1;
-  int max_y = screen_rect.height / CELL_SIZE + 1;
+  /* shift the pixels of scrolled regions; the debug overlay is drawn over
+  ** the surface and would be shifted along, so regions are redrawn then */
+  if (show_debug) { scroll_region_count = 0; }
+  apply_scroll_regions();
+
+  /* mark all cells changed from last frame, reset cells */
+  int max_x = cells_x, max_y = cells_y;
+  stats->changed_cells = 0;
   for (int y = 0; y < max_y; y++) {
     for (int x = 0; x < max_x; x++) {
       /* compare previous and current cell for change */
       int idx = cell_idx(x, y);
-      if (cells[idx] != cells_prev[idx]) {
-        push_rect((RenRect) { x, y, 1, 1 }, &rect_count);
-      }
+      bool changed = scroll_state[idx] == SCROLL_NONE ? cells[idx] != cells_prev[idx] : scroll_state[idx] == SCROLL_DIRTY;
+      dirty_cells[idx] = changed;
+      stats->changed_cells += changed;
       cells_prev[idx] = HASH_INITIAL;
+      scroll_state[idx] = SCROLL_NONE;
     }
   }
 
-  /* expand rects from cells to pixels */
-  for (int i = 0; i < rect_count; i++) {
-    RenRect *r = &rect_buf[i];
-    r->x *= CELL_SIZE;
-    r->y *= CELL_SIZE;
-    r->width *= CELL_SIZE;
-    r->height *= CELL_SIZE;
-    *r = intersect_rects(*r, screen_rect);
+  /* the frame graph is drawn over whatever lies below it every frame */
+  if (show_debug) {
+    RenRect g = frame_graph_rect();
+    int x1 = max(g.x, 0) / cell_size, y1 = max(g.y, 0) / cell_size;
+    int x2 = min((g.x + g.width) / cell_size, max_x - 1), y2 = min((g.y + g.height) / cell_size, max_y - 1);
+    for (int y = y1; y <= y2; y++) {
+      for (int x = x1; x <= x2; x++) {
+        int idx = cell_idx(x, y);
+        stats->changed_cells += !dirty_cells[idx];
+        dirty_cells[idx] = true;
+      }
+    }
+  }
+  int rect_count = coalesce_dirty_cells(max_x, max_y);
+  stats->hash = seconds_since(stage_start);
+  stage_start = SDL_GetPerformanceCounter();
+
+  /* rects drawn concurrently must not share any pixel */
+  bool threaded = render_thread_count > 1 && rect_count > 1;
+  if (threaded) {
+    rect_count = merge_intersecting_rects(rect_count);
+    threaded = rect_count > 1 && prepare_fonts_for_threads();
   }
 
-  /* redraw updated regions */
+  stats->redrawn_cells = 0;
   for (int i = 0; i < rect_count; i++) {
-    /* draw */
-    RenRect r = rect_buf[i];
-    ren_set_clip_rect(r);
+    stats->redrawn_cells += rect_area(rect_buf[i]);
+  }
 
-    cmd = NULL;
-    while (next_command(&cmd)) {
-      switch (cmd->type) {
-        case SET_CLIP:
-          ren_set_clip_rect(intersect_rects(cmd->rect, r));
-          break;
-        case DRAW_RECT:
-          ren_draw_rect(cmd->rect, cmd->color);
-          break;
-        case DRAW_TEXT:
-          ren_font_set_tab_size(cmd->font, cmd->tab_size);
-          ren_draw_text(cmd->font, cmd->text, cmd->text_x, cmd->rect.y, cmd->color);
-          break;
-      }
+  /* each rendering thread needs a bitmask with one bit per binned command */
+  int words = (binned_commands_count + 63) / 64;
+  if (bins_valid && words > replay_masks_words) {
+    uint64_t *masks = calloc((size_t) words * 2 * MAX_RENDER_THREADS, sizeof(uint64_t));
+    if (masks) {
+      free(replay_masks);
+      replay_masks = masks;
+      replay_masks_words = words * 2;
+    } else {
+      bins_valid = false;
     }
+  }
 
-    if (show_debug) {
+  /* redraw updated regions; rects are expanded from cells to pixels as
+  ** they are drawn so the bins of their cells can be looked up */
+  if (threaded) {
+    int workers = min(render_thread_count, rect_count) - 1;
+    render_rect_count = rect_count;
+    SDL_AtomicSet(&render_next_rect, 0);
+    for (int i = 0; i < workers; i++) {
+      SDL_SemPost(render_work_sem);
+    }
+    draw_pending_regions(0);
+    for (int i = 0; i < workers; i++) {
+      SDL_SemWait(render_done_sem);
+    }
+  } else {
+    for (int i = 0; i < rect_count; i++) {
+      draw_region(rect_buf[i], 0);
+    }
+  }
+
+  /* expand rects from cells to pixels */
+  stats->rects = rect_count;
+  stats->pixels = 0;
+  for (int i = 0; i < rect_count; i++) {
+    RenRect *r = &rect_buf[i];
+    r->x *= cell_size;
+    r->y *= cell_size;
+    r->width *= cell_size;
+    r->height *= cell_size;
+    *r = intersect_rects(*r, screen_rect);
+    stats->pixels += (size_t) r->width * r->height;
+  }
+
+  if (show_debug) {
+    for (int i = 0; i < rect_count; i++) {
       RenColor color = { rand(), rand(), rand(), 50 };
-      ren_draw_rect(r, color);
+      ren_set_clip_rect(rect_buf[i]);
+      ren_draw_rect(rect_buf[i], color);
     }
+    draw_frame_graph();
+  }
+  stats->replay = seconds_since(stage_start);
+  stage_start = SDL_GetPerformanceCounter();
+
+  /* blitted regions are shown without being redrawn */
+  for (int i = 0; i < scroll_blit_count && rect_count < MAX_CELLS; i++) {
+    rect_buf[rect_count++] = intersect_rects(scroll_blits[i], screen_rect);
   }
 
   /* update dirty rects */
   if (rect_count > 0) {
     ren_update_rects(rect_buf, rect_count);
+    stats->uploaded = ren_get_uploaded_bytes();
   }
+  /* a frame with nothing to update still answers the keys polled before it */
+  record_input_latency();
+  stats->present = seconds_since(stage_start);
+  stats->glyph_misses = glyph_loads() - frame_glyph_loads;
+  frame_stats[frame_stats_index] = *stats;
+  frame_stats_index = (frame_stats_index + 1) % FRAME_STATS_HISTORY;
+  memset(stats, 0, sizeof(*stats));
 
   /* swap cell buffer and reset */
-  unsigned *tmp = cells;
+  uint64_t *tmp = cells;
   cells = cells_prev;
   cells_prev = tmp;
-  command_buf_idx = 0;
+  reset_commands();
 }
-
@@ -2,16 +2,53 @@
 #define RENCACHE_H
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <lua.h>
 #include "renderer.h"
 
+typedef struct {
+  /* seconds spent in each stage of the frame */
+  double events, update, draw, hash, replay, present;
+  int commands, rects;
+  /* cells whose content changed and cells covered by the redrawn rects */
+  int changed_cells, redrawn_cells;
+  size_t pixels, glyph_misses;
+  /* bytes sent to the screen */
+  size_t uploaded;
+} RenFrameStats;
+
+typedef struct {
+  /* keypresses measured, and their latency to the present in seconds */
+  int count;
+  double p50, p99, max, mean;
+} RenLatencyStats;
+
+/* a piece of text drawn by rencache_draw_tokens */
+typedef struct {
+  RenFont *font;
+  RenColor color;
+  const char *text;
+  size_t len;
+} RenTextSpan;
+
 void  rencache_show_debug(bool enable);
 void  rencache_set_clip_rect(RenRect rect);
 void  rencache_draw_rect(RenRect rect, RenColor color);
+void  rencache_scroll_region(RenRect rect, int dy);
 float rencache_draw_text(lua_State *L, RenFont *font, 
   const char *text, float x, int y, RenColor color);
+float rencache_draw_tokens(lua_State *L, const RenTextSpan *spans, int count, float x, int y);
+void  rencache_set_render_threads(int n);
 void  rencache_invalidate(void);
 void  rencache_begin_frame(lua_State *L);
 void  rencache_end_frame(lua_State *L);
+void  rencache_get_command_buffer_stats(size_t *last_frame, size_t *capacity, size_t *high_water);
+/* passes the commands issued since the frame began, as they are hashed */
+void  rencache_each_command(void (*fn)(const void *data, size_t size, void *udata), void *udata);
+void  rencache_set_frame_times(double events, double update);
+void  rencache_get_frame_stats(RenFrameStats *stats);
+void  rencache_input_event(Uint32 timestamp);
+void  rencache_get_input_latency(RenLatencyStats *stats);
+void  rencache_reset_input_latency(void);
 
 #endif
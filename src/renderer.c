@@ -9,14 +9,23 @@
 
 #include "renderer.h"
 #include "renwindow.h"
+#include "renblend.h"
 
-#define DIVIDE_BY_255_SIGNED(x, sign_val)  (((x) + (sign_val) + ((x)>>8)) >> 8)
-#define DIVIDE_BY_255(x)    DIVIDE_BY_255_SIGNED(x, 1)
-#define MAX_GLYPHSET 256
 #define SUBPIXEL_BITMAPS_CACHED 3
+#define GLYPH_BUCKETS_MIN 256
+#define ATLAS_PAGE_SIZE 512
+#define TEXT_WIDTH_CACHE_SIZE 2048
+#define TEXT_WIDTH_CACHE_MAX_LEN 256
+#define LAYOUT_BUCKETS 1024
+#define LAYOUT_CACHE_LIMIT (2 * 1024 * 1024)
+#define LAYOUT_MAX_LEN 4096
 
 static RenWindow window_renderer = {0};
 static FT_Library library;
+static SDL_mutex *glyph_mutex;
+/* Clipping rect in pixel coordinates. Each rendering thread keeps its own
+   so that separate regions of the surface can be drawn concurrently. */
+static _Thread_local RenRect clip;
 
 static void* check_alloc(void *ptr) {
   if (!ptr) {
@@ -34,22 +43,101 @@ typedef struct {
   float xadvance;
 } GlyphMetric;
 
-typedef struct {
-  SDL_Surface* surface;
-  GlyphMetric metrics[256]; 
-} GlyphSet;
+/* Glyph bitmaps are rasterized one at a time, when first needed, and packed
+   in shelves into atlas pages owned by the font. All the pages are kept in a
+   list ordered by creation; when the pages and glyphs use more memory than
+   the cache limit the least recently drawn pages are evicted with their
+   glyphs. */
+typedef struct GlyphPage {
+  SDL_Surface *surface;
+  struct RenFont *font;
+  int shelf_x, shelf_y, shelf_height;
+  SDL_atomic_t last_used;
+  struct Glyph *glyphs;
+  struct GlyphPage *prev, *next;
+} GlyphPage;
+
+/* Glyphs are first loaded for their advance only, as measuring text is far
+   more common than drawing every glyph of it; the bitmap is rendered the
+   first time the glyph is drawn at that subpixel phase. */
+typedef struct Glyph {
+  unsigned int codepoint;
+  int subpixel_idx;
+  bool rasterized;
+  GlyphMetric metric;
+  GlyphPage *page; /* NULL for glyphs without a bitmap */
+  struct Glyph *next;
+  struct Glyph *page_next;
+} Glyph;
 
 typedef struct RenFont {
   FT_Face face;
-  GlyphSet* sets[SUBPIXEL_BITMAPS_CACHED][MAX_GLYPHSET];
+  Glyph **glyphs; /* hash table keyed by codepoint and subpixel index */
+  int glyph_buckets, glyph_count;
+  int paged_count; /* glyphs with a bitmap in a page */
+  GlyphPage *page; /* page receiving new glyphs */
   float size, space_advance, tab_advance;
-  short max_height;
+  SDL_Thread *loader;
+  SDL_atomic_t loading, cancel_loading;
   bool subpixel;
   ERenFontHinting hinting;
   unsigned char style;
+  struct RenFont *prev, *next;
   char path[0];
 } RenFont;
 
+static RenFont *fonts;
+static GlyphPage *pages_head, *pages_tail;
+static size_t glyph_cache_size, glyph_cache_limit = 32 * 1024 * 1024;
+static int current_frame;
+static RenGlyphStats glyph_stats;
+static Uint32 font_loaded_event = (Uint32)-1;
+
+/* Widths of recently measured strings, direct mapped by a hash of the font,
+   its tab width and the text. Only short strings are kept, as they are the
+   ones measured over and over (tokens, labels, single characters). */
+typedef struct {
+  RenFont *font;
+  float tab_advance, width;
+  unsigned hash;
+  size_t len;
+  char text[TEXT_WIDTH_CACHE_MAX_LEN];
+} TextWidth;
+
+static TextWidth *text_widths;
+
+/* Glyph runs of recently drawn strings: the glyphs and pen positions of a
+   text drawn from a given x, so that drawing it again at the same place
+   skips decoding and glyph lookups. Each rendering thread keeps its own LRU
+   bounded cache; runs point to glyphs, so all caches are dropped whenever
+   glyphs are freed, by bumping layout_generation. */
+typedef struct {
+  struct Glyph *glyph;
+  int x;
+} LayoutGlyph;
+
+typedef struct LayoutRun {
+  struct LayoutRun *next, *lru_prev, *lru_next;
+  struct RenFont *font;
+  float pen_x, tab_advance, end_x;
+  unsigned hash;
+  size_t len, size;
+  int count;
+  char *text;
+  LayoutGlyph glyphs[];
+} LayoutRun;
+
+typedef struct {
+  LayoutRun **buckets;
+  LayoutRun *lru_head, *lru_tail;
+  size_t size;
+  int generation;
+} LayoutCache;
+
+static _Thread_local LayoutCache layout_cache;
+static SDL_atomic_t layout_generation;
+static SDL_atomic_t layout_hits, layout_misses, layout_evicted, layout_cache_size;
+
 static const char* utf8_to_codepoint(const char *p, unsigned *dst) {
   unsigned res, n;
   switch (*p & 0xf0) {
@@ -105,54 +193,235 @@ static int font_set_style(FT_Outline* outline, int x_translation, unsigned char
   return 0;
 }
 
-void font_load_glyphset(RenFont* font, int idx) {
+static inline unsigned glyph_bucket(RenFont *font, unsigned int codepoint, int subpixel_idx) {
+  return ((codepoint * SUBPIXEL_BITMAPS_CACHED + subpixel_idx) * 2654435761u) & (font->glyph_buckets - 1);
+}
+
+static GlyphPage* font_page_alloc(RenFont *font, int width, int height) {
+  GlyphPage *page = check_alloc(calloc(1, sizeof(GlyphPage)));
+  width = width > ATLAS_PAGE_SIZE ? width : ATLAS_PAGE_SIZE;
+  height = height > ATLAS_PAGE_SIZE ? height : ATLAS_PAGE_SIZE;
+  page->surface = check_alloc(SDL_CreateRGBSurface(0, width, height, font->subpixel ? 24 : 8, 0, 0, 0, 0));
+  page->font = font;
+  SDL_AtomicSet(&page->last_used, current_frame);
+  page->prev = pages_tail;
+  if (pages_tail)
+    pages_tail->next = page;
+  else
+    pages_head = page;
+  pages_tail = page;
+  glyph_cache_size += page->surface->pitch * page->surface->h;
+  return page;
+}
+
+static void font_page_free(GlyphPage *page) {
+  RenFont *font = page->font;
+  for (Glyph *glyph = page->glyphs, *page_next; glyph; glyph = page_next) {
+    page_next = glyph->page_next;
+    Glyph **link = &font->glyphs[glyph_bucket(font, glyph->codepoint, glyph->subpixel_idx)];
+    while (*link != glyph)
+      link = &(*link)->next;
+    *link = glyph->next;
+    font->glyph_count--;
+    font->paged_count--;
+    glyph_stats.evicted++;
+    glyph_cache_size -= sizeof(Glyph);
+    free(glyph);
+  }
+  if (font->page == page)
+    font->page = NULL;
+  if (page->prev) page->prev->next = page->next; else pages_head = page->next;
+  if (page->next) page->next->prev = page->prev; else pages_tail = page->prev;
+  glyph_cache_size -= page->surface->pitch * page->surface->h;
+  SDL_FreeSurface(page->surface);
+  free(page);
+  SDL_AtomicIncRef(&layout_generation);
+}
+
+/* finds room for a width x height bitmap in the font's current page, starting
+   a new shelf or a new page when it doesn't fit */
+static GlyphPage* font_page_reserve(RenFont *font, int width, int height, int *x, int *y) {
+  GlyphPage *page = font->page;
+  if (page && page->shelf_x + width > page->surface->w) {
+    page->shelf_y += page->shelf_height;
+    page->shelf_x = page->shelf_height = 0;
+  }
+  if (!page || page->shelf_y + height > page->surface->h)
+    page = font->page = font_page_alloc(font, width, height);
+  *x = page->shelf_x;
+  *y = page->shelf_y;
+  page->shelf_x += width;
+  page->shelf_height = height > page->shelf_height ? height : page->shelf_height;
+  return page;
+}
+
+static void font_measure_glyph(RenFont* font, Glyph* glyph) {
+  int glyph_index = FT_Get_Char_Index(font->face, glyph->codepoint);
+  glyph_stats.measured++;
+  if (!glyph_index || FT_Load_Glyph(font->face, glyph_index, font_set_load_options(font) | FT_LOAD_BITMAP_METRICS_ONLY))
+    return;
+  FT_GlyphSlot slot = font->face->glyph;
+  glyph->metric.xadvance = (slot->advance.x + slot->lsb_delta - slot->rsb_delta) / 64.0f;
+}
+
+static void font_rasterize_glyph(RenFont* font, Glyph* glyph, bool measure) {
   unsigned int render_option = font_set_render_options(font), load_option = font_set_load_options(font);
-  int bitmaps_cached = font->subpixel ? SUBPIXEL_BITMAPS_CACHED : 1;
   unsigned int byte_width = font->subpixel ? 3 : 1;
-  for (int j = 0, pen_x = 0; j < bitmaps_cached; ++j) {
-    GlyphSet* set = check_alloc(calloc(1, sizeof(GlyphSet)));
-    font->sets[j][idx] = set;
-    for (int i = 0; i < 256; ++i) {
-      int glyph_index = FT_Get_Char_Index( font->face, i + idx * MAX_GLYPHSET);
-      if (!glyph_index || FT_Load_Glyph(font->face, glyph_index, load_option | FT_LOAD_BITMAP_METRICS_ONLY) || font_set_style(&font->face->glyph->outline, j * (64 / SUBPIXEL_BITMAPS_CACHED), font->style) || FT_Render_Glyph(font->face->glyph, render_option))
-        continue;
-      FT_GlyphSlot slot = font->face->glyph;
-      int glyph_width = slot->bitmap.width / byte_width;
-      set->metrics[i] = (GlyphMetric){ pen_x, pen_x + glyph_width, 0, slot->bitmap.rows, slot->bitmap_left, slot->bitmap_top, (slot->advance.x + slot->lsb_delta - slot->rsb_delta) / 64.0f};
-      pen_x += glyph_width;
-      font->max_height = slot->bitmap.rows > font->max_height ? slot->bitmap.rows : font->max_height;
+  int glyph_index = FT_Get_Char_Index(font->face, glyph->codepoint);
+  glyph_stats.rasterized++;
+  if (!glyph_index || FT_Load_Glyph(font->face, glyph_index, load_option) || font_set_style(&font->face->glyph->outline, glyph->subpixel_idx * (64 / SUBPIXEL_BITMAPS_CACHED), font->style) || FT_Render_Glyph(font->face->glyph, render_option))
+    goto done;
+  FT_GlyphSlot slot = font->face->glyph;
+  int glyph_width = slot->bitmap.width / byte_width, x = 0, y = 0;
+  GlyphPage *page = NULL;
+  if (glyph_width > 0 && slot->bitmap.rows > 0) {
+    page = font_page_reserve(font, glyph_width, slot->bitmap.rows, &x, &y);
+    unsigned char* pixels = page->surface->pixels;
+    for (int line = 0; line < slot->bitmap.rows; ++line) {
+      int target_offset = page->surface->pitch * (y + line) + x * byte_width;
+      int source_offset = line * slot->bitmap.pitch;
+      memcpy(&pixels[target_offset], &slot->bitmap.buffer[source_offset], slot->bitmap.width);
     }
-    if (pen_x == 0)
-      continue;
-    set->surface = check_alloc(SDL_CreateRGBSurface(0, pen_x, font->max_height, font->subpixel ? 24 : 8, 0, 0, 0, 0));
-    unsigned char* pixels = set->surface->pixels;
-    for (int i = 0; i < 256; ++i) {
-      int glyph_index = FT_Get_Char_Index(font->face, i + idx * MAX_GLYPHSET);
-      if (!glyph_index || FT_Load_Glyph(font->face, glyph_index, load_option))
+    glyph->page_next = page->glyphs;
+    page->glyphs = glyph;
+    font->paged_count++;
+  }
+  /* other threads may be drawing the glyph unlocked: its page and bitmap
+     metrics are stored only once the bitmap is copied, and read only once
+     they see rasterized set */
+  glyph->metric.x0 = x;
+  glyph->metric.x1 = x + glyph_width;
+  glyph->metric.y0 = y;
+  glyph->metric.y1 = y + slot->bitmap.rows;
+  glyph->metric.bitmap_left = slot->bitmap_left;
+  glyph->metric.bitmap_top = slot->bitmap_top;
+  /* measured glyphs may have their advance read by other threads already */
+  if (measure)
+    glyph->metric.xadvance = (slot->advance.x + slot->lsb_delta - slot->rsb_delta) / 64.0f;
+  glyph->page = page;
+  done:
+  SDL_MemoryBarrierRelease();
+  glyph->rasterized = true;
+}
+
+static inline bool glyph_is_rasterized(Glyph* glyph) {
+  bool rasterized = glyph->rasterized;
+  SDL_MemoryBarrierAcquire();
+  return rasterized;
+}
+
+static Glyph* font_find_glyph(RenFont* font, unsigned int codepoint, int subpixel_idx) {
+  for (Glyph* glyph = font->glyphs[glyph_bucket(font, codepoint, subpixel_idx)]; glyph; glyph = glyph->next) {
+    if (glyph->codepoint == codepoint && glyph->subpixel_idx == subpixel_idx)
+      return glyph;
+  }
+  return NULL;
+}
+
+static Glyph* font_load_glyph(RenFont* font, unsigned int codepoint, int subpixel_idx, bool rasterized);
+
+static Glyph* font_get_glyph(RenFont* font, unsigned int codepoint, int subpixel_idx, bool rasterized) {
+  Glyph* glyph = font_find_glyph(font, codepoint, subpixel_idx);
+  if (glyph && (!rasterized || glyph_is_rasterized(glyph)))
+    return glyph;
+  /* glyphs can be requested by several rendering threads at once, lookups
+     are done unlocked so a glyph is only published once complete */
+  SDL_LockMutex(glyph_mutex);
+  glyph = font_load_glyph(font, codepoint, subpixel_idx, rasterized);
+  SDL_UnlockMutex(glyph_mutex);
+  return glyph;
+}
+
+static Glyph* font_load_glyph(RenFont* font, unsigned int codepoint, int subpixel_idx, bool rasterized) {
+  Glyph* glyph = font_find_glyph(font, codepoint, subpixel_idx);
+  if (!glyph) {
+    glyph = check_alloc(calloc(1, sizeof(Glyph)));
+    glyph->codepoint = codepoint;
+    glyph->subpixel_idx = subpixel_idx;
+    if (rasterized)
+      font_rasterize_glyph(font, glyph, true);
+    else
+      font_measure_glyph(font, glyph);
+    unsigned bucket = glyph_bucket(font, codepoint, subpixel_idx);
+    glyph->next = font->glyphs[bucket];
+    SDL_MemoryBarrierRelease();
+    font->glyphs[bucket] = glyph;
+    font->glyph_count++;
+    glyph_cache_size += sizeof(Glyph);
+  } else if (rasterized && !glyph->rasterized) {
+    font_rasterize_glyph(font, glyph, false);
+  }
+  return glyph;
+}
+
+static void font_rehash_glyphs(RenFont* font, int buckets) {
+  Glyph** old_glyphs = font->glyphs;
+  int old_buckets = font->glyph_buckets;
+  font->glyphs = check_alloc(calloc(buckets, sizeof(Glyph*)));
+  font->glyph_buckets = buckets;
+  for (int i = 0; i < old_buckets; ++i) {
+    for (Glyph *glyph = old_glyphs[i], *next; glyph; glyph = next) {
+      next = glyph->next;
+      unsigned bucket = glyph_bucket(font, glyph->codepoint, glyph->subpixel_idx);
+      glyph->next = font->glyphs[bucket];
+      font->glyphs[bucket] = glyph;
+    }
+  }
+  free(old_glyphs);
+}
+
+/* drops the glyphs that have no bitmap in a page, mostly glyphs that were
+   only measured, which have no page to be evicted with */
+static void font_free_unpaged_glyphs(RenFont* font) {
+  for (int i = 0; i < font->glyph_buckets; ++i) {
+    for (Glyph **link = &font->glyphs[i], *glyph; (glyph = *link); ) {
+      if (glyph->page) {
+        link = &glyph->next;
         continue;
-      FT_GlyphSlot slot = font->face->glyph;
-      font_set_style(&slot->outline, (64 / bitmaps_cached) * j, font->style);
-      if (FT_Render_Glyph(slot, render_option))
-        continue; 
-      for (int line = 0; line < slot->bitmap.rows; ++line) {
-        int target_offset = set->surface->pitch * line + set->metrics[i].x0 * byte_width;
-        int source_offset = line * slot->bitmap.pitch;
-        memcpy(&pixels[target_offset], &slot->bitmap.buffer[source_offset], slot->bitmap.width);
       }
+      *link = glyph->next;
+      font->glyph_count--;
+      glyph_stats.evicted++;
+      glyph_cache_size -= sizeof(Glyph);
+      free(glyph);
     }
   }
+  SDL_AtomicIncRef(&layout_generation);
+}
+
+static inline float glyph_advance(RenFont* font, Glyph* glyph) {
+  if (glyph->codepoint == '\t' && font->tab_advance)
+    return font->tab_advance;
+  return glyph->metric.xadvance ? glyph->metric.xadvance : font->space_advance;
 }
 
-static GlyphSet* font_get_glyphset(RenFont* font, unsigned int codepoint, int subpixel_idx) {
-  int idx = (codepoint >> 8) % MAX_GLYPHSET;
-  if (!font->sets[subpixel_idx][idx])
-    font_load_glyphset(font, idx);
-  return font->sets[subpixel_idx][idx];
+/* Rasterizes the printable ASCII glyphs of a font loaded asynchronously. The
+   glyph lock is taken for each glyph, as the main thread may rehash the
+   font's glyphs or evict its pages in between. */
+static int font_warm_up(void* data) {
+  RenFont* font = data;
+  for (unsigned int codepoint = ' '; codepoint < 127 && !SDL_AtomicGet(&font->cancel_loading); ++codepoint) {
+    for (int i = 0; i < (font->subpixel ? SUBPIXEL_BITMAPS_CACHED : 1); ++i) {
+      SDL_LockMutex(glyph_mutex);
+      font_load_glyph(font, codepoint, i, true);
+      SDL_UnlockMutex(glyph_mutex);
+    }
+  }
+  SDL_AtomicSet(&font->loading, 0);
+  if (font_loaded_event != (Uint32)-1) {
+    SDL_Event event = { .type = font_loaded_event };
+    SDL_PushEvent(&event);
+  }
+  return 0;
 }
 
 RenFont* ren_font_load(const char* path, float size, bool subpixel, unsigned char hinting, unsigned char style) {
   FT_Face face;
-  if (FT_New_Face( library, path, 0, &face))
+  /* the library is shared with the font loading threads */
+  SDL_LockMutex(glyph_mutex);
+  int error = FT_New_Face(library, path, 0, &face);
+  SDL_UnlockMutex(glyph_mutex);
+  if (error)
     return NULL;
 
   const int surface_scale = renwin_surface_scale(&window_renderer);
@@ -166,54 +435,131 @@ RenFont* ren_font_load(const char* path, float size, bool subpixel, unsigned cha
   font->subpixel = subpixel;
   font->hinting = hinting;
   font->style = style;
-  font->space_advance = (int)font_get_glyphset(font, ' ', 0)->metrics[' '].xadvance;
+  font->glyph_buckets = GLYPH_BUCKETS_MIN;
+  font->glyphs = check_alloc(calloc(font->glyph_buckets, sizeof(Glyph*)));
+  SDL_LockMutex(glyph_mutex);
+  font->next = fonts;
+  if (fonts)
+    fonts->prev = font;
+  fonts = font;
+  SDL_UnlockMutex(glyph_mutex);
+  font->space_advance = (int)font_get_glyph(font, ' ', 0, false)->metric.xadvance;
   font->tab_advance = font->space_advance * 2;
   return font;
   failure:  
+  SDL_LockMutex(glyph_mutex);
   FT_Done_Face(face);
+  SDL_UnlockMutex(glyph_mutex);
   return NULL;
 }
 
-RenFont* ren_font_copy(RenFont* font, float size) {
+RenFont* ren_font_load_async(const char* path, float size, bool subpixel, unsigned char hinting, unsigned char style) {
+  RenFont* font = ren_font_load(path, size, subpixel, hinting, style);
+  if (!font)
+    return NULL;
+  SDL_AtomicSet(&font->loading, 1);
+  font->loader = SDL_CreateThread(font_warm_up, "font_loader", font);
+  if (!font->loader) {
+    fprintf(stderr, "Warning: (" __FILE__ "): unable to create font loading thread: %s\n", SDL_GetError());
+    SDL_AtomicSet(&font->loading, 0);
+  }
+  return font;
+}
+
+RenFont* ren_font_copy(RenFont* font, float size, bool async) {
+  if (async)
+    return ren_font_load_async(font->path, size, font->subpixel, font->hinting, font->style);
   return ren_font_load(font->path, size, font->subpixel, font->hinting, font->style);
 }
 
+bool ren_font_is_loading(RenFont* font) {
+  return SDL_AtomicGet(&font->loading);
+}
+
 void ren_font_free(RenFont* font) {
-  for (int i = 0; i < SUBPIXEL_BITMAPS_CACHED; ++i) {
-    for (int j = 0; j < MAX_GLYPHSET; ++j) {
-      if (font->sets[i][j]) {
-        if (font->sets[i][j]->surface)
-          SDL_FreeSurface(font->sets[i][j]->surface);
-        free(font->sets[i][j]);
-      }
-    }
+  if (font->loader) {
+    SDL_AtomicSet(&font->cancel_loading, 1);
+    SDL_WaitThread(font->loader, NULL);
+  }
+  SDL_LockMutex(glyph_mutex);
+  for (GlyphPage *page = pages_head, *next; page; page = next) {
+    next = page->next;
+    if (page->font == font)
+      font_page_free(page);
+  }
+  font_free_unpaged_glyphs(font);
+  free(font->glyphs);
+  if (font->prev) font->prev->next = font->next; else fonts = font->next;
+  if (font->next) font->next->prev = font->prev;
+  SDL_AtomicIncRef(&layout_generation);
+  for (int i = 0; text_widths && i < TEXT_WIDTH_CACHE_SIZE; ++i) {
+    if (text_widths[i].font == font)
+      text_widths[i].font = NULL;
   }
   FT_Done_Face(font->face);
+  SDL_UnlockMutex(glyph_mutex);
   free(font);
 }
 
 void ren_font_set_tab_size(RenFont *font, int n) {
-  for (int i = 0; i < (font->subpixel ? SUBPIXEL_BITMAPS_CACHED : 1); ++i) 
-    font_get_glyphset(font, '\t', i)->metrics['\t'].xadvance = font->space_advance * n;
+  font->tab_advance = font->space_advance * n;
 }
 
 int ren_font_get_tab_size(RenFont *font) {
-  return font_get_glyphset(font, '\t', 0)->metrics['\t'].xadvance / font->space_advance;
+  return font->tab_advance / font->space_advance;
+}
+
+static unsigned text_width_hash(RenFont *font, const char *text, size_t len) {
+  unsigned h = 2166136261u ^ (unsigned)(uintptr_t)font ^ (unsigned)font->tab_advance;
+  for (size_t i = 0; i < len; i++)
+    h = (h ^ (unsigned char)text[i]) * 16777619;
+  return h;
 }
 
 float ren_font_get_width(RenFont *font, const char *text) {
+  const int surface_scale = renwin_surface_scale(&window_renderer);
+  size_t len = strlen(text);
+  TextWidth *entry = NULL;
+  if (len <= TEXT_WIDTH_CACHE_MAX_LEN) {
+    if (!text_widths)
+      text_widths = check_alloc(calloc(TEXT_WIDTH_CACHE_SIZE, sizeof(TextWidth)));
+    unsigned h = text_width_hash(font, text, len);
+    entry = &text_widths[h % TEXT_WIDTH_CACHE_SIZE];
+    if (entry->font == font && entry->hash == h && entry->tab_advance == font->tab_advance && entry->len == len && memcmp(entry->text, text, len) == 0)
+      return entry->width / surface_scale;
+    entry->font = font;
+    entry->hash = h;
+    entry->tab_advance = font->tab_advance;
+    entry->len = len;
+    memcpy(entry->text, text, len);
+  }
   float width = 0;
-  const char* end = text + strlen(text);
+  const char* end = text + len;
   while (text < end) {
     unsigned int codepoint;
     text = utf8_to_codepoint(text, &codepoint);
-    GlyphMetric* metric = &font_get_glyphset(font, codepoint, 0)->metrics[codepoint % 256];
-    width += metric->xadvance ? metric->xadvance : font->space_advance;
+    width += glyph_advance(font, font_get_glyph(font, codepoint, 0, false));
   }
-  const int surface_scale = renwin_surface_scale(&window_renderer);
+  if (entry)
+    entry->width = width;
   return width / surface_scale;
 }
 
+void ren_font_get_offsets(RenFont *font, const char *text, size_t len, float *offsets) {
+  const int surface_scale = renwin_surface_scale(&window_renderer);
+  float width = 0;
+  const char *p = text, *end = text + len;
+  while (p < end) {
+    unsigned int codepoint;
+    const char *next = utf8_to_codepoint(p, &codepoint);
+    next = next < end ? next : end;
+    for (; p < next; p++)
+      offsets[p - text] = width / surface_scale;
+    width += glyph_advance(font, font_get_glyph(font, codepoint, 0, false));
+  }
+  offsets[len] = width / surface_scale;
+}
+
 float ren_font_get_size(RenFont *font) {
   return font->size;
 }
@@ -221,62 +567,183 @@ int ren_font_get_height(RenFont *font) {
   return font->size + 3;
 }
 
+/* blits a glyph drawn with the pen at pen_x on the line at y, in pixels;
+   glyphs of loading fonts that aren't rasterized yet are skipped */
+static void draw_glyph(SDL_Surface *surface, RenFont *font, Glyph *glyph, int pen_x, int y, RenColor color) {
+  if (!glyph_is_rasterized(glyph))
+    return;
+  GlyphMetric* metric = &glyph->metric;
+  int start_x = pen_x + metric->bitmap_left;
+  int end_x = start_x + metric->x1 - metric->x0;
+  int clip_end_x = clip.x + clip.width, clip_end_y = clip.y + clip.height;
+  int glyph_end = metric->x1, glyph_start = metric->x0;
+  if (!glyph->page || color.a == 0 || end_x <= clip.x || start_x >= clip_end_x)
+    return;
+  SDL_Surface* atlas = glyph->page->surface;
+  if (SDL_AtomicGet(&glyph->page->last_used) != current_frame)
+    SDL_AtomicSet(&glyph->page->last_used, current_frame);
+  /* never touch pixels left of the clip, they may belong to a region
+     that another thread is drawing */
+  if (start_x < clip.x) {
+    glyph_start += clip.x - start_x;
+    start_x = clip.x;
+  }
+  int surface_scale = renwin_surface_scale(&window_renderer);
+  int bytes_per_pixel = surface->format->BytesPerPixel;
+  unsigned char* destination_pixels = surface->pixels;
+  unsigned char* source_pixels = atlas->pixels;
+  for (int line = metric->y0; line < metric->y1; ++line) {
+    int target_y = line + y - metric->y0 - metric->bitmap_top + font->size * surface_scale;
+    if (target_y < clip.y)
+      continue;
+    if (target_y >= clip_end_y)
+      break;
+    if (start_x + (glyph_end - glyph_start) >= clip_end_x)
+      glyph_end = glyph_start + (clip_end_x - start_x);
+    if (glyph_end <= glyph_start)
+      continue;
+    uint32_t* destination_pixel = (uint32_t*)&destination_pixels[surface->pitch * target_y + start_x * bytes_per_pixel];
+    unsigned char* source_pixel = &source_pixels[line * atlas->pitch + glyph_start * (font->subpixel ? 3 : 1)];
+    if (font->subpixel)
+      ren_blend.glyph_subpixel(destination_pixel, source_pixel, glyph_end - glyph_start, color);
+    else
+      ren_blend.glyph_gray(destination_pixel, source_pixel, glyph_end - glyph_start, color);
+  }
+}
+
+static inline Glyph* font_get_glyph_at(RenFont *font, unsigned int codepoint, float pen_x, bool rasterized) {
+  int bitmap_index = font->subpixel ? (int)(fmod(pen_x, 1.0) * SUBPIXEL_BITMAPS_CACHED) : 0;
+  return font_get_glyph(font, codepoint, bitmap_index + (bitmap_index < 0 ? SUBPIXEL_BITMAPS_CACHED : 0), rasterized);
+}
+
+/*************** Layout cache ****************/
+static unsigned layout_hash(RenFont *font, const char *text, size_t len, float pen_x) {
+  unsigned h = text_width_hash(font, text, len);
+  uint32_t bits;
+  memcpy(&bits, &pen_x, sizeof(bits));
+  return (h ^ bits) * 16777619;
+}
+
+static void layout_cache_unlink(LayoutCache *cache, LayoutRun *run) {
+  if (run->lru_prev) run->lru_prev->lru_next = run->lru_next; else cache->lru_head = run->lru_next;
+  if (run->lru_next) run->lru_next->lru_prev = run->lru_prev; else cache->lru_tail = run->lru_prev;
+}
+
+static void layout_cache_push(LayoutCache *cache, LayoutRun *run) {
+  run->lru_prev = NULL;
+  run->lru_next = cache->lru_head;
+  if (cache->lru_head) cache->lru_head->lru_prev = run; else cache->lru_tail = run;
+  cache->lru_head = run;
+}
+
+static void layout_cache_remove(LayoutCache *cache, LayoutRun *run) {
+  LayoutRun **link = &cache->buckets[run->hash % LAYOUT_BUCKETS];
+  while (*link != run)
+    link = &(*link)->next;
+  *link = run->next;
+  layout_cache_unlink(cache, run);
+  cache->size -= run->size;
+  SDL_AtomicAdd(&layout_cache_size, -(int) run->size);
+  free(run);
+}
+
+static void layout_cache_clear(LayoutCache *cache) {
+  while (cache->lru_head)
+    layout_cache_remove(cache, cache->lru_head);
+}
+
+/* finds the run of text drawn from pen_x, laying it out if it isn't cached */
+static LayoutRun* layout_text(RenFont *font, const char *text, size_t len, float pen_x) {
+  LayoutCache *cache = &layout_cache;
+  int generation = SDL_AtomicGet(&layout_generation);
+  if (!cache->buckets)
+    cache->buckets = check_alloc(calloc(LAYOUT_BUCKETS, sizeof(LayoutRun*)));
+  if (cache->generation != generation) {
+    layout_cache_clear(cache);
+    cache->generation = generation;
+  }
+  unsigned h = layout_hash(font, text, len, pen_x);
+  for (LayoutRun *run = cache->buckets[h % LAYOUT_BUCKETS]; run; run = run->next) {
+    if (run->hash == h && run->font == font && run->pen_x == pen_x && run->tab_advance == font->tab_advance
+     && run->len == len && memcmp(run->text, text, len) == 0) {
+      layout_cache_unlink(cache, run);
+      layout_cache_push(cache, run);
+      SDL_AtomicIncRef(&layout_hits);
+      return run;
+    }
+  }
+  SDL_AtomicIncRef(&layout_misses);
+
+  /* a codepoint takes at least a byte: len glyphs is enough */
+  size_t size = sizeof(LayoutRun) + len * sizeof(LayoutGlyph) + len;
+  LayoutRun *run = check_alloc(malloc(size));
+  run->font = font;
+  run->hash = h;
+  run->pen_x = pen_x;
+  run->tab_advance = font->tab_advance;
+  run->len = len;
+  run->size = size;
+  run->text = (char*) &run->glyphs[len];
+  memcpy(run->text, text, len);
+  run->count = 0;
+  const char *end = text + len;
+  while (text < end) {
+    unsigned int codepoint;
+    text = utf8_to_codepoint(text, &codepoint);
+    Glyph *glyph = font_get_glyph_at(font, codepoint, pen_x, true);
+    run->glyphs[run->count++] = (LayoutGlyph) { glyph, floor(pen_x) };
+    pen_x += glyph_advance(font, glyph);
+  }
+  run->end_x = pen_x;
+
+  while (cache->lru_tail && cache->size + size > LAYOUT_CACHE_LIMIT) {
+    layout_cache_remove(cache, cache->lru_tail);
+    SDL_AtomicIncRef(&layout_evicted);
+  }
+  run->next = cache->buckets[h % LAYOUT_BUCKETS];
+  cache->buckets[h % LAYOUT_BUCKETS] = run;
+  layout_cache_push(cache, run);
+  cache->size += size;
+  SDL_AtomicAdd(&layout_cache_size, size);
+  return run;
+}
+
+void ren_free_thread_caches(void) {
+  layout_cache_clear(&layout_cache);
+  free(layout_cache.buckets);
+  layout_cache.buckets = NULL;
+}
+
+void ren_get_layout_stats(RenLayoutStats *stats) {
+  stats->hits = (unsigned) SDL_AtomicGet(&layout_hits);
+  stats->misses = (unsigned) SDL_AtomicGet(&layout_misses);
+  stats->evicted = (unsigned) SDL_AtomicGet(&layout_evicted);
+  stats->cache_size = SDL_AtomicGet(&layout_cache_size);
+}
+
 float ren_draw_text(RenFont *font, const char *text, float x, int y, RenColor color) {
   SDL_Surface *surface = renwin_get_surface(&window_renderer);
-  const RenRect clip = window_renderer.clip;
 
   const int surface_scale = renwin_surface_scale(&window_renderer);
   float pen_x = x * surface_scale;
   y *= surface_scale;
-  int bytes_per_pixel = surface->format->BytesPerPixel;
-  const char* end = text + strlen(text);
-  unsigned char* destination_pixels = surface->pixels;
-  int clip_end_x = clip.x + clip.width, clip_end_y = clip.y + clip.height;
-  while (text < end) {
-    unsigned int codepoint, r, g, b;
-    text = utf8_to_codepoint(text, &codepoint);
-    int bitmap_index = font->subpixel ? (int)(fmod(pen_x, 1.0) * SUBPIXEL_BITMAPS_CACHED) : 0;
-    GlyphSet* set = font_get_glyphset(font, codepoint, bitmap_index + (bitmap_index < 0 ? SUBPIXEL_BITMAPS_CACHED : 0));
-    GlyphMetric* metric = &set->metrics[codepoint % 256];
-    int start_x = floor(pen_x) + metric->bitmap_left, end_x = metric->x1 - metric->x0 + pen_x;
-    int glyph_end = metric->x1, glyph_start = metric->x0;
-    if (set->surface && color.a > 0 && end_x >= clip.x && start_x < clip_end_x) {
-      unsigned char* source_pixels = set->surface->pixels;
-      for (int line = metric->y0; line < metric->y1; ++line) {
-        int target_y = line + y - metric->y0 - metric->bitmap_top + font->size * surface_scale;
-        if (target_y < clip.y)
-          continue;
-        if (target_y >= clip_end_y)
-          break;
-        if (start_x + (glyph_end - glyph_start) >= clip_end_x)
-          glyph_end = glyph_start + (clip_end_x - start_x);
-        unsigned int* destination_pixel = (unsigned int*)&destination_pixels[surface->pitch * target_y + start_x * bytes_per_pixel];
-        unsigned char* source_pixel = &source_pixels[line * set->surface->pitch + metric->x0 * (font->subpixel ? 3 : 1)];
-        for (int x = glyph_start; x < glyph_end; ++x) {
-          unsigned int destination_color = *destination_pixel;
-          SDL_Color dst = { (destination_color >> 16) & 0xFF, (destination_color >> 8) & 0xFF, (destination_color >> 0) & 0xFF, (destination_color >> 24) & 0xFF };
-          if (font->subpixel) {
-            SDL_Color src = { *source_pixel++, *source_pixel++, *source_pixel++ };
-            r = color.r * src.r + dst.r * (255 - src.r) + 127;
-            r = DIVIDE_BY_255(r);
-            g = color.g * src.g + dst.g * (255 - src.g) + 127;
-            g = DIVIDE_BY_255(g);
-            b = color.b * src.b + dst.b * (255 - src.b) + 127;
-            b = DIVIDE_BY_255(b);
-          } else {
-            unsigned char intensity = *source_pixel++;
-            r = color.r * intensity + dst.r * (255 - intensity) + 127;
-            r = DIVIDE_BY_255(r);
-            g = color.g * intensity + dst.g * (255 - intensity) + 127;
-            g = DIVIDE_BY_255(g);
-            b = color.b * intensity + dst.b * (255 - intensity) + 127;
-            b = DIVIDE_BY_255(b);
-          }
-          *destination_pixel++ = dst.a << 24 | r << 16 | g << 8 | b;
-        }
-      }
+  size_t len = strlen(text);
+  /* fonts still loading only lay out text, the frame is redrawn once ready */
+  if (SDL_AtomicGet(&font->loading) || len > LAYOUT_MAX_LEN) {
+    bool rasterized = !SDL_AtomicGet(&font->loading);
+    const char* end = text + len;
+    while (text < end) {
+      unsigned int codepoint;
+      text = utf8_to_codepoint(text, &codepoint);
+      Glyph *glyph = font_get_glyph_at(font, codepoint, pen_x, rasterized);
+      draw_glyph(surface, font, glyph, floor(pen_x), y, color);
+      pen_x += glyph_advance(font, glyph);
     }
-    pen_x += metric->xadvance ? metric->xadvance  : font->space_advance;
+  } else {
+    LayoutRun *run = layout_text(font, text, len, pen_x);
+    for (int i = 0; i < run->count; i++)
+      draw_glyph(surface, font, run->glyphs[i].glyph, run->glyphs[i].x, y, color);
+    pen_x = run->end_x;
   }
   if (font->style & FONT_STYLE_UNDERLINE)
     ren_draw_rect((RenRect){ x, y / surface_scale + ren_font_get_height(font) - 1, (pen_x - x) / surface_scale, 1 }, color);
@@ -284,14 +751,6 @@ float ren_draw_text(RenFont *font, const char *text, float x, int y, RenColor co
 }
 
 /******************* Rectangles **********************/
-static inline RenColor blend_pixel(RenColor dst, RenColor src) {
-  int ia = 0xff - src.a;
-  dst.r = ((src.r * src.a) + (dst.r * ia)) >> 8;
-  dst.g = ((src.g * src.a) + (dst.g * ia)) >> 8;
-  dst.b = ((src.b * src.a) + (dst.b * ia)) >> 8;
-  return dst;
-}
-
 void ren_draw_rect(RenRect rect, RenColor color) {
   if (color.a == 0) { return; }
 
@@ -303,7 +762,6 @@ void ren_draw_rect(RenRect rect, RenColor color) {
   rect.width  *= surface_scale;
   rect.height *= surface_scale;
 
-  const RenRect clip = window_renderer.clip;
   int x1 = rect.x < clip.x ? clip.x : rect.x;
   int y1 = rect.y < clip.y ? clip.y : rect.y;
   int x2 = rect.x + rect.width;
@@ -314,40 +772,125 @@ void ren_draw_rect(RenRect rect, RenColor color) {
   SDL_Surface *surface = renwin_get_surface(&window_renderer);
   RenColor *d = (RenColor*) surface->pixels;
   d += x1 + y1 * surface->w;
-  int dr = surface->w - (x2 - x1);
 
   if (color.a == 0xff) {
     SDL_Rect rect = { x1, y1, x2 - x1, y2 - y1 };
     SDL_FillRect(surface, &rect, SDL_MapRGBA(surface->format, color.r, color.g, color.b, color.a));
-  } else {
-    for (int j = y1; j < y2; j++) {
-      for (int i = x1; i < x2; i++, d++)
-        *d = blend_pixel(*d, color);
-      d += dr;
+  } else if (x2 > x1) {
+    for (int j = y1; j < y2; j++, d += surface->w)
+      ren_blend.rect(d, x2 - x1, color);
+  }
+}
+
+void ren_scroll_rect(RenRect rect, int dy) {
+  SDL_Surface *surface = renwin_get_surface(&window_renderer);
+  const int scale = renwin_surface_scale(&window_renderer);
+  int x1 = rect.x * scale, y1 = rect.y * scale;
+  int x2 = x1 + rect.width * scale, y2 = y1 + rect.height * scale;
+  x1 = x1 < 0 ? 0 : x1, y1 = y1 < 0 ? 0 : y1;
+  x2 = x2 > surface->w ? surface->w : x2, y2 = y2 > surface->h ? surface->h : y2;
+  dy *= scale;
+  int rows = y2 - y1 - abs(dy), bytes_per_pixel = surface->format->BytesPerPixel;
+  if (x2 <= x1 || rows <= 0)
+    return;
+  unsigned char *pixels = (unsigned char*) surface->pixels + x1 * bytes_per_pixel;
+  /* copy rows away from the direction of the move so none is overwritten
+     before being copied */
+  for (int i = 0; i < rows; i++) {
+    int row = dy > 0 ? rows - 1 - i : i;
+    int to = y1 + row + (dy > 0 ? dy : 0), from = y1 + row + (dy < 0 ? -dy : 0);
+    memmove(pixels + to * surface->pitch, pixels + from * surface->pitch, (x2 - x1) * bytes_per_pixel);
+  }
+}
+
+/*************** Glyph cache ****************/
+void ren_begin_frame(void) {
+  /* no rendering threads run here: it is safe to drop and move glyphs once
+     font loading threads are kept out */
+  SDL_LockMutex(glyph_mutex);
+  current_frame++;
+  while (glyph_cache_size > glyph_cache_limit) {
+    /* keep the pages drawn in the last frame, even above the limit */
+    GlyphPage *lru = NULL;
+    for (GlyphPage *page = pages_head; page; page = page->next) {
+      int last_used = SDL_AtomicGet(&page->last_used);
+      if (last_used < current_frame - 1 && (!lru || last_used < SDL_AtomicGet(&lru->last_used)))
+        lru = page;
     }
+    if (!lru)
+      break;
+    font_page_free(lru);
   }
+  /* then the font with the most glyphs outside of pages measures them again
+     as needed, unless they are too few to be worth it */
+  while (glyph_cache_size > glyph_cache_limit) {
+    RenFont *largest = NULL;
+    for (RenFont *font = fonts; font; font = font->next) {
+      if (!largest || font->glyph_count - font->paged_count > largest->glyph_count - largest->paged_count)
+        largest = font;
+    }
+    if (!largest || (largest->glyph_count - largest->paged_count) * sizeof(Glyph) < glyph_cache_limit / 8)
+      break;
+    font_free_unpaged_glyphs(largest);
+  }
+  for (RenFont *font = fonts; font; font = font->next) {
+    if (font->glyph_count > font->glyph_buckets * 2)
+      font_rehash_glyphs(font, font->glyph_buckets * 4);
+  }
+  SDL_UnlockMutex(glyph_mutex);
+}
+
+void ren_set_glyph_cache_limit(size_t bytes) {
+  glyph_cache_limit = bytes;
+}
+
+Uint32 ren_font_loaded_event(void) {
+  return font_loaded_event;
+}
+
+void ren_get_glyph_stats(RenGlyphStats *stats) {
+  *stats = glyph_stats;
+  stats->cache_size = glyph_cache_size;
 }
 
 /*************** Window Management ****************/
 void ren_free_window_resources() {
+  ren_free_thread_caches();
   renwin_free(&window_renderer);
 }
 
-void ren_init(SDL_Window *win) {
-  assert(win);
+static bool ren_init_common(void) {
   int error = FT_Init_FreeType( &library );
   if ( error ) {
     fprintf(stderr, "internal font error when starting the application\n");
-    return;
+    return false;
   }
+  glyph_mutex = SDL_CreateMutex();
+  font_loaded_event = SDL_RegisterEvents(1);
+  ren_blend_init();
+  return true;
+}
+
+void ren_init(SDL_Window *win) {
+  assert(win);
+  if (!ren_init_common())
+    return;
   window_renderer.window = win;
   renwin_init_surface(&window_renderer);
-  renwin_clip_to_surface(&window_renderer);
+  ren_clip_to_surface();
+}
+
+void ren_init_headless(int width, int height) {
+  if (!ren_init_common())
+    return;
+  renwin_init_headless(&window_renderer, width, height);
+  ren_clip_to_surface();
 }
 
 
 void ren_resize_window() {
   renwin_resize_surface(&window_renderer);
+  ren_clip_to_surface();
 }
 
 
@@ -361,8 +904,25 @@ void ren_update_rects(RenRect *rects, int count) {
 }
 
 
+void ren_set_double_buffer(bool enable) {
+  renwin_set_double_buffer(&window_renderer, enable);
+}
+
+
+size_t ren_get_uploaded_bytes(void) {
+  return window_renderer.uploaded;
+}
+
+
 void ren_set_clip_rect(RenRect rect) {
-  renwin_set_clip_rect(&window_renderer, rect);
+  const int scale = renwin_surface_scale(&window_renderer);
+  clip = (RenRect) { rect.x * scale, rect.y * scale, rect.width * scale, rect.height * scale };
+}
+
+
+void ren_clip_to_surface() {
+  SDL_Surface *surface = renwin_get_surface(&window_renderer);
+  clip = (RenRect) { 0, 0, surface->w, surface->h };
 }
 
 
@@ -374,3 +934,12 @@ void ren_get_size(int *x, int *y) {
   *y = surface->h / scale;
 }
 
+
+int ren_get_scale(void) {
+  return renwin_surface_scale(&window_renderer);
+}
+
+
+SDL_Surface *ren_get_surface(void) {
+  return renwin_get_surface(&window_renderer);
+}
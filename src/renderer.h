@@ -10,24 +10,43 @@ typedef enum { FONT_HINTING_NONE, FONT_HINTING_SLIGHT, FONT_HINTING_FULL } ERenF
 typedef enum { FONT_STYLE_BOLD = 1, FONT_STYLE_ITALIC = 2, FONT_STYLE_UNDERLINE = 4 } ERenFontStyle;
 typedef struct { uint8_t b, g, r, a; } RenColor;
 typedef struct { int x, y, width, height; } RenRect;
+typedef struct { size_t measured, rasterized, evicted, cache_size; } RenGlyphStats;
+typedef struct { size_t hits, misses, evicted, cache_size; } RenLayoutStats;
 
 RenFont* ren_font_load(const char *filename, float size, bool subpixel, unsigned char hinting, unsigned char style);
-RenFont* ren_font_copy(RenFont* font, float size);
+RenFont* ren_font_load_async(const char *filename, float size, bool subpixel, unsigned char hinting, unsigned char style);
+RenFont* ren_font_copy(RenFont* font, float size, bool async);
+bool ren_font_is_loading(RenFont *font);
+Uint32 ren_font_loaded_event(void);
 void ren_font_free(RenFont *font);
 void ren_font_set_tab_size(RenFont *font, int n);
 int ren_font_get_tab_size(RenFont *font);
 float ren_font_get_width(RenFont *font, const char *text);
+void ren_font_get_offsets(RenFont *font, const char *text, size_t len, float *offsets);
 int ren_font_get_height(RenFont *font);
 float ren_font_get_size(RenFont *font);
 float ren_draw_text(RenFont *font, const char *text, float x, int y, RenColor color);
 
 void ren_draw_rect(RenRect rect, RenColor color);
+void ren_scroll_rect(RenRect rect, int dy);
+
+void ren_begin_frame(void);
+void ren_set_glyph_cache_limit(size_t bytes);
+void ren_get_glyph_stats(RenGlyphStats *stats);
+void ren_get_layout_stats(RenLayoutStats *stats);
+void ren_free_thread_caches(void); /* Called by rendering threads before they exit. */
 
 void ren_init(SDL_Window *win);
+void ren_init_headless(int width, int height);
 void ren_resize_window();
 void ren_update_rects(RenRect *rects, int count);
+void ren_set_double_buffer(bool enable);
+size_t ren_get_uploaded_bytes(void); /* Bytes sent to the screen by the last update. */
 void ren_set_clip_rect(RenRect rect);
+void ren_clip_to_surface();
 void ren_get_size(int *x, int *y); /* Reports the size in points. */
+int ren_get_scale(void); /* Reports the pixels per point. */
+SDL_Surface *ren_get_surface(void); /* The surface frames are drawn into. */
 void ren_free_window_resources();
 
 
@@ -0,0 +1,60 @@
+#ifndef RENHASH_H
+#define RENHASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/* 64bit hash of the rencache commands, in the style of wyhash: input is
+** consumed 16 bytes at a time and mixed by folding the 128bit product of two
+** words. Cells hold 64bit hashes too, so that a collision hiding a change is
+** out of the question */
+#define HASH_INITIAL 0xa0761d6478bd642fULL
+#define HASH_PRIME 0xe7037ed1a0b428dbULL
+
+static inline uint64_t hash_mix(uint64_t a, uint64_t b) {
+#ifdef __SIZEOF_INT128__
+  __uint128_t r = (__uint128_t) a * b;
+  return (uint64_t) r ^ (uint64_t) (r >> 64);
+#else
+  uint64_t ha = a >> 32, la = (uint32_t) a, hb = b >> 32, lb = (uint32_t) b;
+  uint64_t hh = ha * hb, hl = ha * lb, lh = la * hb, ll = la * lb;
+  uint64_t t = ll + (hl << 32), lo = t + (lh << 32);
+  uint64_t hi = hh + (hl >> 32) + (lh >> 32) + (t < ll) + (lo < t);
+  return lo ^ hi;
+#endif
+}
+
+static inline uint64_t read64(const unsigned char *p) {
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static inline uint64_t read32(const unsigned char *p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static inline void hash(uint64_t *h, const void *data, size_t size) {
+  const unsigned char *p = data;
+  uint64_t seed = *h, a = 0, b = 0;
+  size_t len = size;
+  for (; len > 16; len -= 16, p += 16) {
+    seed = hash_mix(read64(p) ^ HASH_PRIME, read64(p + 8) ^ seed);
+  }
+  /* the tail is read as two possibly overlapping words */
+  if (len > 8) {
+    a = read64(p);
+    b = read64(p + len - 8);
+  } else if (len >= 4) {
+    a = read32(p);
+    b = read32(p + len - 4);
+  } else if (len > 0) {
+    a = ((uint64_t) p[0] << 16) | ((uint64_t) p[len >> 1] << 8) | p[len - 1];
+  }
+  *h = hash_mix(a ^ HASH_PRIME ^ size, b ^ seed);
+}
+
+#endif
@@ -1,6 +1,25 @@
 #include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include "renwindow.h"
 
+#if defined(LITE_USE_X11_SHM) && defined(LITE_USE_SDL_RENDERER)
+#error "LITE_USE_X11_SHM only applies to the software path"
+#endif
+
+#ifdef LITE_USE_X11_SHM
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <SDL_syswm.h>
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+#include <X11/extensions/XShm.h>
+#ifndef SDL_VIDEO_DRIVER_X11
+#error "LITE_USE_X11_SHM needs SDL built with the X11 video driver"
+#endif
+#endif
+
 #ifdef LITE_USE_SDL_RENDERER
 static int query_surface_scale(RenWindow *ren) {
   int w_pixels, h_pixels;
@@ -13,21 +32,189 @@ static int query_surface_scale(RenWindow *ren) {
   return w_pixels / w_points;
 }
 
+static SDL_Texture *create_texture(RenWindow *ren, int w, int h) {
+  return SDL_CreateTexture(ren->renderer, SDL_PIXELFORMAT_BGRA32, SDL_TEXTUREACCESS_STREAMING, w, h);
+}
+
 static void setup_renderer(RenWindow *ren, int w, int h) {
   /* Note that w and h here should always be in pixels and obtained from
      a call to SDL_GL_GetDrawableSize(). */
   if (ren->renderer) {
-    SDL_DestroyTexture(ren->texture);
+    for (int i = 0; i < 2; i++) {
+      if (ren->textures[i]) { SDL_DestroyTexture(ren->textures[i]); }
+      ren->textures[i] = NULL;
+    }
     SDL_DestroyRenderer(ren->renderer);
   }
   ren->renderer = SDL_CreateRenderer(ren->window, -1, 0);
-  ren->texture = SDL_CreateTexture(ren->renderer, SDL_PIXELFORMAT_BGRA32, SDL_TEXTUREACCESS_STREAMING, w, h);
+  ren->textures[0] = create_texture(ren, w, h);
+  if (ren->double_buffer) {
+    ren->textures[1] = create_texture(ren, w, h);
+  }
+  ren->texture_stale[0] = ren->texture_stale[1] = true;
+  ren->texture_index = 0;
+  ren->upload_count = 0;
   ren->surface_scale = query_surface_scale(ren);
 }
+
+/* copies rects of the surface into the texture. Locked pixels are write-only
+   and the whole locked area has to be written, so the rects are sent in a
+   single lock of their bounding box only when it isn't much larger than
+   they are; otherwise each rect is updated on its own */
+static size_t upload_rects(RenWindow *ren, SDL_Texture *texture, const SDL_Rect *rects, int count) {
+  SDL_Surface *surface = ren->surface;
+  SDL_Rect box = rects[0];
+  size_t area = 0;
+  for (int i = 0; i < count; i++) {
+    SDL_UnionRect(&box, &rects[i], &box);
+    area += (size_t) rects[i].w * rects[i].h;
+  }
+  void *pixels;
+  int pitch;
+  if ((size_t) box.w * box.h <= area * 2 && SDL_LockTexture(texture, &box, &pixels, &pitch) == 0) {
+    const char *src = (const char *) surface->pixels + box.y * surface->pitch + box.x * 4;
+    for (int y = 0; y < box.h; y++) {
+      memcpy((char *) pixels + y * pitch, src + y * surface->pitch, box.w * 4);
+    }
+    SDL_UnlockTexture(texture);
+    return (size_t) box.w * box.h * 4;
+  }
+  for (int i = 0; i < count; i++) {
+    const SDL_Rect *r = &rects[i];
+    const char *src = (const char *) surface->pixels + r->y * surface->pitch + r->x * 4;
+    SDL_UpdateTexture(texture, r, src, surface->pitch);
+  }
+  return area * 4;
+}
+#endif
+
+
+#ifdef LITE_USE_X11_SHM
+/* On X11 the surface can be an image in a shared memory segment attached by
+   the server, which XShmPutImage then presents without the copies done by
+   SDL_UpdateWindowSurfaceRects. Any failure, including not running on X11
+   or on a remote display, falls back to the window surface of SDL. */
+struct RenShm {
+  Display *display;
+  Window window;
+  GC gc;
+  XImage *image;
+  XShmSegmentInfo info;
+  SDL_Surface *surface;
+};
+
+static bool shm_error;
+
+static int shm_error_handler(Display *display, XErrorEvent *event) {
+  shm_error = true;
+  return 0;
+}
+
+static void shm_free(struct RenShm *shm) {
+  if (shm->surface) {
+    SDL_FreeSurface(shm->surface);
+  }
+  if (shm->info.shmaddr) {
+    XShmDetach(shm->display, &shm->info);
+    XSync(shm->display, False);
+    shmdt(shm->info.shmaddr);
+  }
+  if (shm->image) {
+    /* the pixels belong to the segment */
+    shm->image->data = NULL;
+    XDestroyImage(shm->image);
+  }
+  if (shm->gc) {
+    XFreeGC(shm->display, shm->gc);
+  }
+  free(shm);
+}
+
+static struct RenShm *shm_create(SDL_Window *window, int w, int h) {
+  SDL_SysWMinfo wm;
+  SDL_VERSION(&wm.version);
+  if (!SDL_GetWindowWMInfo(window, &wm) || wm.subsystem != SDL_SYSWM_X11) {
+    return NULL;
+  }
+  Display *display = wm.info.x11.display;
+  XWindowAttributes attributes;
+  if (!XShmQueryExtension(display) || !XGetWindowAttributes(display, wm.info.x11.window, &attributes)) {
+    return NULL;
+  }
+  /* the renderer draws 32 bit pixels laid out as BGRA in memory */
+  Visual *visual = attributes.visual;
+  if (attributes.depth < 24 || visual->red_mask != 0xff0000 || visual->green_mask != 0xff00 || visual->blue_mask != 0xff) {
+    return NULL;
+  }
+
+  struct RenShm *shm = calloc(1, sizeof(struct RenShm));
+  if (!shm) {
+    return NULL;
+  }
+  shm->display = display;
+  shm->window = wm.info.x11.window;
+  shm->info.shmid = -1;
+  shm->image = XShmCreateImage(display, visual, attributes.depth, ZPixmap, NULL, &shm->info, w, h);
+  if (!shm->image || shm->image->bits_per_pixel != 32 || shm->image->bytes_per_line != w * 4) {
+    goto failure;
+  }
+  shm->info.shmid = shmget(IPC_PRIVATE, (size_t) shm->image->bytes_per_line * h, IPC_CREAT | 0600);
+  if (shm->info.shmid < 0) {
+    goto failure;
+  }
+  shm->info.shmaddr = shm->image->data = shmat(shm->info.shmid, NULL, 0);
+  if (shm->info.shmaddr == (char *) -1) {
+    shm->info.shmaddr = NULL;
+    goto failure;
+  }
+  shm->info.readOnly = True;
+  /* attaching fails asynchronously, e.g. on a remote display */
+  shm_error = false;
+  XSync(display, False);
+  int (*handler)(Display*, XErrorEvent*) = XSetErrorHandler(shm_error_handler);
+  XShmAttach(display, &shm->info);
+  XSync(display, False);
+  XSetErrorHandler(handler);
+  if (shm_error) {
+    shmdt(shm->info.shmaddr);
+    shm->info.shmaddr = NULL;
+    goto failure;
+  }
+  /* the segment goes away once both sides have detached */
+  shmctl(shm->info.shmid, IPC_RMID, NULL);
+  shm->info.shmid = -1;
+
+  shm->gc = XCreateGC(display, shm->window, 0, NULL);
+  shm->surface = SDL_CreateRGBSurfaceWithFormatFrom(shm->image->data, w, h, 32, shm->image->bytes_per_line, SDL_PIXELFORMAT_BGRA32);
+  if (!shm->gc || !shm->surface) {
+    goto failure;
+  }
+  return shm;
+
+failure:
+  if (shm->info.shmid >= 0) {
+    shmctl(shm->info.shmid, IPC_RMID, NULL);
+  }
+  shm_free(shm);
+  return NULL;
+}
+
+static void shm_update_rects(struct RenShm *shm, RenRect *rects, int count) {
+  for (int i = 0; i < count; i++) {
+    const RenRect *r = &rects[i];
+    XShmPutImage(shm->display, shm->window, shm->gc, shm->image, r->x, r->y, r->x, r->y, r->width, r->height, False);
+  }
+  /* the next frame is drawn into the same pixels: wait for the server to be
+     done reading them */
+  XSync(shm->display, False);
+}
 #endif
 
 
 void renwin_init_surface(RenWindow *ren) {
+  if (ren->offscreen) {
+    return;
+  }
 #ifdef LITE_USE_SDL_RENDERER
   if (ren->surface) {
     SDL_FreeSurface(ren->surface);
@@ -37,9 +224,29 @@ void renwin_init_surface(RenWindow *ren) {
   ren->surface = SDL_CreateRGBSurfaceWithFormat(0, w, h, 32, SDL_PIXELFORMAT_BGRA32);
   setup_renderer(ren, w, h);
 #endif
+#ifdef LITE_USE_X11_SHM
+  if (ren->shm) {
+    shm_free(ren->shm);
+  }
+  int w, h;
+  SDL_GetWindowSize(ren->window, &w, &h);
+  ren->shm = shm_create(ren->window, w, h);
+#endif
+}
+
+void renwin_init_headless(RenWindow *ren, int width, int height) {
+  ren->window = NULL;
+  ren->offscreen = SDL_CreateRGBSurfaceWithFormat(0, width, height, 32, SDL_PIXELFORMAT_BGRA32);
+  if (!ren->offscreen) {
+    fprintf(stderr, "Fatal error: unable to create a %dx%d headless surface: %s\n", width, height, SDL_GetError());
+    exit(EXIT_FAILURE);
+  }
 }
 
 int renwin_surface_scale(RenWindow *ren) {
+  if (ren->offscreen) {
+    return 1;
+  }
 #ifdef LITE_USE_SDL_RENDERER
   return ren->surface_scale;
 #else
@@ -48,71 +255,156 @@ int renwin_surface_scale(RenWindow *ren) {
 }
 
 
-static RenRect scaled_rect(const RenRect rect, const int scale) {
-  return (RenRect) {rect.x * scale, rect.y * scale, rect.width * scale, rect.height * scale};
-}
-
-
-void renwin_clip_to_surface(RenWindow *ren) {
-  SDL_Surface *surface = renwin_get_surface(ren);
-  ren->clip = (RenRect) {0, 0, surface->w, surface->h};
-}
-
-
-void renwin_set_clip_rect(RenWindow *ren, RenRect rect) {
-  ren->clip = scaled_rect(rect, renwin_surface_scale(ren));
-}
-
-
 SDL_Surface *renwin_get_surface(RenWindow *ren) {
+  if (ren->offscreen) {
+    return ren->offscreen;
+  }
 #ifdef LITE_USE_SDL_RENDERER
   return ren->surface;
 #else
+#ifdef LITE_USE_X11_SHM
+  if (ren->shm) {
+    return ren->shm->surface;
+  }
+#endif
   return SDL_GetWindowSurface(ren->window);
 #endif
 }
 
 void renwin_resize_surface(RenWindow *ren) {
+  if (ren->offscreen) {
+    return;
+  }
 #ifdef LITE_USE_SDL_RENDERER
   int new_w, new_h;
   SDL_GL_GetDrawableSize(ren->window, &new_w, &new_h);
   /* Note that (w, h) may differ from (new_w, new_h) on retina displays. */
   if (new_w != ren->surface->w || new_h != ren->surface->h) {
     renwin_init_surface(ren);
-    renwin_clip_to_surface(ren);
     setup_renderer(ren, new_w, new_h);
   }
 #endif
+#ifdef LITE_USE_X11_SHM
+  int new_w, new_h;
+  SDL_GetWindowSize(ren->window, &new_w, &new_h);
+  if (ren->shm && (new_w != ren->shm->surface->w || new_h != ren->shm->surface->h)) {
+    renwin_init_surface(ren);
+  }
+#endif
 }
 
 void renwin_show_window(RenWindow *ren) {
-  SDL_ShowWindow(ren->window);
+  if (ren->window) {
+    SDL_ShowWindow(ren->window);
+  }
 }
 
 void renwin_update_rects(RenWindow *ren, RenRect *rects, int count) {
+  ren->uploaded = 0;
+  if (ren->offscreen || count == 0) {
+    return;
+  }
 #ifdef LITE_USE_SDL_RENDERER
+  /* the rects of the previous update are kept at the front of the buffer */
   const int scale = ren->surface_scale;
+  int kept = ren->double_buffer ? ren->upload_count : 0;
+  int needed = kept + count;
+  if (needed > ren->upload_capacity) {
+    int capacity = ren->upload_capacity > 0 ? ren->upload_capacity : 64;
+    while (capacity < needed) { capacity *= 2; }
+    SDL_Rect *upload_rects = realloc(ren->upload_rects, capacity * sizeof(SDL_Rect));
+    if (!upload_rects) {
+      fprintf(stderr, "Warning: (" __FILE__ "): unable to allocate upload rects\n");
+      ren->texture_stale[0] = ren->texture_stale[1] = true;
+      needed = kept = count = 0;
+    } else {
+      ren->upload_rects = upload_rects;
+      ren->upload_capacity = capacity;
+    }
+  }
+  SDL_Rect *current = ren->upload_rects + kept;
   for (int i = 0; i < count; i++) {
     const RenRect *r = &rects[i];
-    const int x = scale * r->x, y = scale * r->y;
-    const int w = scale * r->width, h = scale * r->height;
-    const SDL_Rect sr = {.x = x, .y = y, .w = w, .h = h};
-    int32_t *pixels = ((int32_t *) ren->surface->pixels) + x + ren->surface->w * y;
-    SDL_UpdateTexture(ren->texture, &sr, pixels, ren->surface->w * 4);
+    current[i] = (SDL_Rect) { .x = scale * r->x, .y = scale * r->y, .w = scale * r->width, .h = scale * r->height };
+  }
+
+  int index = ren->double_buffer ? !ren->texture_index : 0;
+  SDL_Texture *texture = ren->textures[index];
+  if (ren->texture_stale[index]) {
+    SDL_Rect all = { 0, 0, ren->surface->w, ren->surface->h };
+    ren->uploaded = upload_rects(ren, texture, &all, 1);
+    ren->texture_stale[index] = false;
+  } else if (needed > 0) {
+    ren->uploaded = upload_rects(ren, texture, ren->upload_rects, needed);
+  }
+  if (kept > 0) {
+    memmove(ren->upload_rects, current, count * sizeof(SDL_Rect));
   }
-  SDL_RenderCopy(ren->renderer, ren->texture, NULL, NULL);
+  ren->upload_count = count;
+  ren->texture_index = index;
+
+  SDL_RenderCopy(ren->renderer, texture, NULL, NULL);
   SDL_RenderPresent(ren->renderer);
 #else
+  for (int i = 0; i < count; i++) {
+    ren->uploaded += (size_t) rects[i].width * rects[i].height * 4;
+  }
+#ifdef LITE_USE_X11_SHM
+  if (ren->shm) {
+    shm_update_rects(ren->shm, rects, count);
+    return;
+  }
+#endif
   SDL_UpdateWindowSurfaceRects(ren->window, (SDL_Rect*) rects, count);
 #endif
 }
 
+void renwin_set_double_buffer(RenWindow *ren, bool enable) {
+#ifdef LITE_USE_SDL_RENDERER
+  if (ren->offscreen || !ren->renderer || ren->double_buffer == enable) {
+    return;
+  }
+  ren->double_buffer = enable;
+  if (enable) {
+    ren->textures[1] = create_texture(ren, ren->surface->w, ren->surface->h);
+    if (!ren->textures[1]) {
+      fprintf(stderr, "Warning: (" __FILE__ "): unable to create texture: %s\n", SDL_GetError());
+      ren->double_buffer = false;
+      return;
+    }
+  } else {
+    SDL_DestroyTexture(ren->textures[1]);
+    ren->textures[1] = NULL;
+  }
+  ren->texture_stale[0] = ren->texture_stale[1] = true;
+  ren->texture_index = 0;
+  ren->upload_count = 0;
+#endif
+}
+
 void renwin_free(RenWindow *ren) {
+  if (ren->offscreen) {
+    SDL_FreeSurface(ren->offscreen);
+    ren->offscreen = NULL;
+    return;
+  }
+#ifdef LITE_USE_X11_SHM
+  if (ren->shm) {
+    shm_free(ren->shm);
+    ren->shm = NULL;
+  }
+#endif
   SDL_DestroyWindow(ren->window);
   ren->window = NULL;
 #ifdef LITE_USE_SDL_RENDERER
-  SDL_DestroyTexture(ren->texture);
+  for (int i = 0; i < 2; i++) {
+    if (ren->textures[i]) { SDL_DestroyTexture(ren->textures[i]); }
+    ren->textures[i] = NULL;
+  }
   SDL_DestroyRenderer(ren->renderer);
   SDL_FreeSurface(ren->surface);
+  free(ren->upload_rects);
+  ren->upload_rects = NULL;
+  ren->upload_count = ren->upload_capacity = 0;
 #endif
 }
@@ -3,23 +3,40 @@
 
 struct RenWindow {
   SDL_Window *window;
-  RenRect clip; /* Clipping rect in pixel coordinates. */
+  /* set when running headless: there is no window and frames are only
+     drawn into this surface */
+  SDL_Surface *offscreen;
+  /* bytes sent to the screen by the last update */
+  size_t uploaded;
+#ifdef LITE_USE_X11_SHM
+  /* set when frames are drawn straight into an image shared with the X
+     server, see renwindow.c */
+  struct RenShm *shm;
+#endif
 #ifdef LITE_USE_SDL_RENDERER
   SDL_Renderer *renderer;
-  SDL_Texture *texture;
   SDL_Surface *surface;
   int surface_scale;
+  /* with double buffering two textures are updated in turn so that the one
+     being written is never the one the last frame was presented from. Each
+     update then also carries the rects of the previous one */
+  SDL_Texture *textures[2];
+  bool texture_stale[2];
+  int texture_index;
+  bool double_buffer;
+  SDL_Rect *upload_rects;
+  int upload_count, upload_capacity;
 #endif
 };
 typedef struct RenWindow RenWindow;
 
 void renwin_init_surface(RenWindow *ren);
+void renwin_init_headless(RenWindow *ren, int width, int height);
 int  renwin_surface_scale(RenWindow *ren);
-void renwin_clip_to_surface(RenWindow *ren);
-void renwin_set_clip_rect(RenWindow *ren, RenRect rect);
 void renwin_resize_surface(RenWindow *ren);
 void renwin_show_window(RenWindow *ren);
 void renwin_update_rects(RenWindow *ren, RenRect *rects, int count);
+void renwin_set_double_buffer(RenWindow *ren, bool enable);
 void renwin_free(RenWindow *ren);
 SDL_Surface *renwin_get_surface(RenWindow *ren);
 